@@ -0,0 +1,121 @@
+/**
+ * @file   bench_exerciser.c
+ * @brief  Benchmark of throughput and fragmentation under the memory exerciser pattern.
+ *
+ * Blocks are allocated and freed round-robin over 16 slots, with random
+ * sizes shrinking as more memory is in use, as test_memory_exerciser does.
+ * The sizes are scaled down so all blocks stay in the heap rather than
+ * getting mappings of their own. With the argument pow2 every size is
+ * rounded up to a power of two.
+ *
+ * The heap starts small and grows by small segments, so its final size
+ * shows how much memory the engine the allocator was built with
+ * (make ENGINE=...) needs to hold the peak of live memory.
+ *
+ * With the argument fill the heap has the fixed size FILL_HEAP instead, not
+ * much more than the live memory, and allocations that fail are counted
+ * rather than fatal. Their rate shows how well free blocks are coalesced at
+ * high fill ratios.
+ */
+
+#define _POSIX_C_SOURCE 200809L   /* clock_gettime, setenv */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mm.h"
+
+#define SLOTS      16
+#define STEPS      2000000
+#define LIVE_LIMIT (4*1024*1024)   /* Total size the random sizes approach */
+#define HEAP_SIZE  (1024*1024)     /* Initial heap size and growth step */
+#define FILL_HEAP  "4608K"         /* Heap size with the argument fill, including the main thread's arena */
+
+#if defined(MM_TLSF)
+#define ENGINE     "tlsf"
+#elif defined(MM_BUDDY)
+#define ENGINE     "buddy"
+#elif defined(MM_BITMAP)
+#define ENGINE     "bitmap"
+#else
+#define ENGINE     "segregated"
+#endif
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static size_t round_pow2(size_t size) {
+  return size <= 1 ? 1 : (size_t) 1 << (64 - __builtin_clzl(size - 1));
+}
+
+int main(int argc, char **argv) {
+  int pow2 = argc > 1 && strcmp(argv[1], "pow2") == 0;
+  int fill = argc > 1 && strcmp(argv[1], "fill") == 0;
+  void *addr[SLOTS] = { NULL };
+  size_t size[SLOTS];
+  size_t total = 0;
+  size_t peak = 0;
+  long ops = 0;
+  long attempts = 0;
+  long failed = 0;
+  unsigned int clock = 0;
+  double t0;
+  int i;
+
+  if (fill) {
+    setenv("MM_HEAP_SIZE", FILL_HEAP, 1);
+    setenv("MM_HEAP_MAX", FILL_HEAP, 1);
+  } else {
+    simple_set_heap_size(HEAP_SIZE);
+  }
+  srand(1);
+
+  t0 = now();
+  for (i = 0; i < STEPS; i++) {
+    size_t s = (LIVE_LIMIT - total) / 4 * (rand() & (1024*1024 - 1)) / (1024*1024);
+
+    if (pow2) {
+      s = round_pow2(s);
+    }
+    if (s > 0 && total + s <= LIVE_LIMIT) {
+      addr[clock] = simple_malloc(s);
+      attempts++;
+      if (addr[clock] == NULL && !fill) {
+        fprintf(stderr, "allocation of %zu bytes failed\n", s);
+        return 1;
+      }
+      if (addr[clock] == NULL) {
+        failed++;
+      } else {
+        size[clock] = s;
+        ops++;
+        total += s;
+        if (total > peak) {
+          peak = total;
+        }
+      }
+    }
+
+    clock = (clock + 1) % SLOTS;
+    if (addr[clock] != NULL) {
+      simple_free(addr[clock]);
+      total -= size[clock];
+      addr[clock] = NULL;
+      ops++;
+    }
+  }
+  for (i = 0; i < SLOTS; i++) {
+    simple_free(addr[i]);
+  }
+
+  printf("%-12s %-10s %8.0f ops/s  peak live %6zu KB  heap %6zu KB  (%.2fx)  failed %ld (%.2f%%)\n", ENGINE,
+         pow2 ? "pow2" : fill ? "fill" : "exerciser", ops / (now() - t0), peak / 1024,
+         (size_t) (memory_end - memory_start) / 1024,
+         (double) (memory_end - memory_start) / peak, failed, 100.0 * failed / attempts);
+  return 0;
+}
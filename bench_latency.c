@@ -0,0 +1,84 @@
+/**
+ * @file   bench_latency.c
+ * @brief  Benchmark of the latency of single simple_malloc calls.
+ *
+ * A fixed number of blocks of random sizes is kept alive, and in each step
+ * a random block is freed and a new one of another random size allocated in
+ * its place. The time of every simple_malloc call is recorded, and the
+ * median, p99, p99.9 and maximum are reported for the engine the allocator
+ * was built with (make ENGINE=...).
+ */
+
+#define _POSIX_C_SOURCE 200809L   /* clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mm.h"
+
+#define BLOCKS     20000
+#define STEPS      1000000
+#define MIN_BLOCK  16
+#define MAX_BLOCK  16384
+
+#if defined(MM_TLSF)
+#define ENGINE     "tlsf"
+#elif defined(MM_BUDDY)
+#define ENGINE     "buddy"
+#elif defined(MM_BITMAP)
+#define ENGINE     "bitmap"
+#else
+#define ENGINE     "segregated"
+#endif
+
+static void *blocks[BLOCKS];
+static long latency[STEPS];
+
+static long now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static size_t random_size(void) {
+  return MIN_BLOCK + rand() % (MAX_BLOCK - MIN_BLOCK);
+}
+
+static int compare_long(const void *a, const void *b) {
+  long x = *(const long *) a;
+  long y = *(const long *) b;
+  return (x > y) - (x < y);
+}
+
+int main(void) {
+  long t0;
+  int i;
+
+  srand(1);
+  for (i = 0; i < BLOCKS; i++) {
+    blocks[i] = simple_malloc(random_size());
+  }
+  for (i = 0; i < STEPS; i++) {
+    int n = rand() % BLOCKS;
+    size_t size = random_size();
+
+    simple_free(blocks[n]);
+    t0 = now_ns();
+    blocks[n] = simple_malloc(size);
+    latency[i] = now_ns() - t0;
+    if (blocks[n] == NULL) {
+      fprintf(stderr, "allocation of %zu bytes failed\n", size);
+      return 1;
+    }
+  }
+  for (i = 0; i < BLOCKS; i++) {
+    simple_free(blocks[i]);
+  }
+
+  qsort(latency, STEPS, sizeof(long), compare_long);
+  printf("%-12s p50 %6ld ns  p99 %6ld ns  p99.9 %6ld ns  max %8ld ns\n", ENGINE,
+         latency[STEPS / 2], latency[STEPS / 100 * 99], latency[STEPS / 1000 * 999],
+         latency[STEPS - 1]);
+  return 0;
+}
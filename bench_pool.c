@@ -0,0 +1,75 @@
+/**
+ * @file   bench_pool.c
+ * @brief  Benchmark of intNode-sized node churn, pool against simple_malloc.
+ *
+ * A fixed number of list nodes is kept alive, and in each step a random
+ * node is freed and a new one allocated in its place, as add_int and
+ * remove_last do in cmd_int.
+ */
+
+#define _POSIX_C_SOURCE 200809L   /* clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "main.h"
+#include "mm.h"
+
+#define NODES     10000
+#define STEPS     2000000
+
+static intNode *nodes[NODES];
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static double churn_malloc(void) {
+  double t0 = now();
+  int i;
+
+  for (i = 0; i < NODES; i++) {
+    nodes[i] = simple_malloc(sizeof(intNode));
+  }
+  for (i = 0; i < STEPS; i++) {
+    int n = rand() % NODES;
+    simple_free(nodes[n]);
+    nodes[n] = simple_malloc(sizeof(intNode));
+    nodes[n]->value = i;
+  }
+  for (i = 0; i < NODES; i++) {
+    simple_free(nodes[i]);
+  }
+  return now() - t0;
+}
+
+static double churn_pool(void) {
+  double t0 = now();
+  Pool *pool = simple_pool_create(sizeof(intNode));
+  int i;
+
+  for (i = 0; i < NODES; i++) {
+    nodes[i] = simple_pool_alloc(pool);
+  }
+  for (i = 0; i < STEPS; i++) {
+    int n = rand() % NODES;
+    simple_pool_free(pool, nodes[n]);
+    nodes[n] = simple_pool_alloc(pool);
+    nodes[n]->value = i;
+  }
+  simple_pool_destroy(pool);
+  return now() - t0;
+}
+
+int main(int argc, char ** argv) {
+  double ops = 2.0 * (NODES + STEPS);
+
+  srand(1);
+  printf("simple_malloc: %.1f ns/op\n", churn_malloc() * 1e9 / ops);
+  srand(1);
+  printf("pool:          %.1f ns/op\n", churn_pool() * 1e9 / ops);
+  return 0;
+}
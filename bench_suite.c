@@ -0,0 +1,357 @@
+/**
+ * @file   bench_suite.c
+ * @brief  Allocator benchmark suite, built optimised and run by make bench.
+ *
+ * Each case allocates and frees blocks in one pattern and prints a CSV line
+ * with the time per block allocated or freed (one simple_malloc or
+ * simple_free call outside the batch case) and the bytes of heap used per
+ * live block beyond the bytes requested, measured when
+ * the most blocks are live. The heap used is its footprint less its free
+ * blocks, so it includes headers, rounding and blocks in the thread cache.
+ *
+ * The heap may grow to HEAP_MAX, which the last case, exhaustion, fills.
+ *
+ * With an argument, only the case of that name runs. make bench-huge runs
+ * tlb_walk with the heap backed by 4 KB pages and by 2 MB pages; the engine
+ * column tells which huge pages were used.
+ */
+
+#define _POSIX_C_SOURCE 200809L   /* clock_gettime, setenv */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mm.h"
+
+#define BLOCKS      100000            /* Blocks live at once in the fill-and-free cases */
+#define ROUNDS      10
+#define RANDOM_LIVE 1000              /* Blocks live at once in random_sizes */
+#define STEPS       1000000
+#define BATCH       64                /* Blocks per request in the batch cases */
+#define HEAP_MAX    "256M"
+
+#if defined(MM_TLSF)
+#define ENGINE      "tlsf"
+#elif defined(MM_BUDDY)
+#define ENGINE      "buddy"
+#elif defined(MM_BITMAP)
+#define ENGINE      "bitmap"
+#else
+#define ENGINE      "segregated"
+#endif
+
+#ifdef MM_COMPACT
+#define HEADER      "+compact"
+#else
+#define HEADER      ""
+#endif
+
+static void *blocks[BLOCKS];
+static size_t sizes[BLOCKS];
+
+/* Time and space of the running case */
+static double t0;
+static size_t used0;
+static double overhead;
+
+static const char *pages[] = { "", "+thp", "+hugetlb" };   /* By memory_huge */
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static size_t heap_used(void) {
+  MallocInfo info = simple_mallinfo();
+  return info.footprint - info.free;
+}
+
+/* Random size in [min, max], uniform on a log scale */
+static size_t log_size(int min_log, int max_log) {
+  int k = min_log + rand() % (max_log - min_log + 1);
+  size_t base = (size_t) 1 << k;
+  return base + (size_t) rand() % base * (k < max_log);
+}
+
+static void begin(void) {
+  overhead = 0;
+  used0 = heap_used();
+  t0 = now();
+}
+
+/* Record the overhead with count blocks of requested bytes live, outside the timing */
+static void measure(long count, size_t requested) {
+  double t = now();
+  double o = ((double) heap_used() - used0 - requested) / count;
+  if (o > overhead) {
+    overhead = o;
+  }
+  t0 += now() - t;
+}
+
+static void end(const char *name, long ops) {
+  printf("%s,%s%s,%ld,%.1f,%.1f\n", name, ENGINE HEADER, pages[memory_huge], ops,
+         (now() - t0) * 1e9 / ops, overhead);
+}
+
+/* Allocate BLOCKS blocks, then free them in LIFO or FIFO order */
+static void fill_and_free(const char *name, int fixed, int lifo) {
+  long ops = 0;
+  int r, i;
+
+  begin();
+  for (r = 0; r < ROUNDS; r++) {
+    size_t requested = 0;
+    for (i = 0; i < BLOCKS; i++) {
+      sizes[i] = fixed ? 64 : log_size(3, 10);
+      blocks[i] = simple_malloc(sizes[i]);
+      requested += sizes[i];
+    }
+    if (r == 0) {
+      measure(BLOCKS, requested);
+    }
+    for (i = 0; i < BLOCKS; i++) {
+      simple_free(blocks[lifo ? BLOCKS - 1 - i : i]);
+    }
+    ops += 2 * BLOCKS;
+  }
+  end(name, ops);
+}
+
+/* Replace random blocks of 8 B to 512 KB */
+static void random_sizes(void) {
+  size_t requested = 0;
+  int i;
+
+  begin();
+  for (i = 0; i < RANDOM_LIVE; i++) {
+    sizes[i] = log_size(3, 19);
+    blocks[i] = simple_malloc(sizes[i]);
+    requested += sizes[i];
+  }
+  for (i = 0; i < STEPS; i++) {
+    int n = rand() % RANDOM_LIVE;
+    requested -= sizes[n];
+    simple_free(blocks[n]);
+    sizes[n] = log_size(3, 19);
+    blocks[n] = simple_malloc(sizes[n]);
+    requested += sizes[n];
+    if (i % (STEPS / 10) == 0) {
+      measure(RANDOM_LIVE, requested);
+    }
+  }
+  for (i = 0; i < RANDOM_LIVE; i++) {
+    simple_free(blocks[i]);
+  }
+  end("random_sizes", 2 * (RANDOM_LIVE + (long) STEPS));
+}
+
+/*
+ * A tenth of the blocks live through the whole case, the others are freed
+ * again after 16 further allocations
+ */
+static void mixed_lifetimes(void) {
+  void *ring[16] = { NULL };
+  size_t requested = 0;
+  long ops = 0;
+  int live = 0;
+  int i;
+
+  begin();
+  for (i = 0; i < STEPS; i++) {
+    size_t size = log_size(3, 12);
+    void *p = simple_malloc(size);
+    ops++;
+    if (i % 10 == 0 && live < BLOCKS) {
+      blocks[live++] = p;
+      requested += size;
+    } else {
+      simple_free(ring[i % 16]);
+      ring[i % 16] = p;
+      ops++;
+    }
+    if (i % (STEPS / 10) == STEPS / 10 - 1) {
+      measure(live, requested);
+    }
+  }
+  for (i = 0; i < 16; i++) {
+    simple_free(ring[i]);
+  }
+  for (i = 0; i < live; i++) {
+    simple_free(blocks[i]);
+  }
+  end("mixed_lifetimes", ops + 16 + live);
+}
+
+/*
+ * Keep BLOCKS list nodes of 16 B (like cmd_int's intNode) live, replacing a
+ * random one in each step. The overhead shows how densely nodes are packed:
+ * a 64 B cache line holds 64 / (16 + overhead) of them.
+ */
+static void node_churn(void) {
+  int i;
+
+  begin();
+  for (i = 0; i < BLOCKS; i++) {
+    blocks[i] = simple_malloc(16);
+  }
+  measure(BLOCKS, BLOCKS * 16);
+  for (i = 0; i < STEPS; i++) {
+    int n = rand() % BLOCKS;
+    simple_free(blocks[n]);
+    blocks[n] = simple_malloc(16);
+  }
+  for (i = 0; i < BLOCKS; i++) {
+    simple_free(blocks[i]);
+  }
+  end("node_churn", 2 * (BLOCKS + (long) STEPS));
+}
+
+/*
+ * Allocate BATCH blocks of 512 B, as a request handler would, and free them
+ * again, one at a time or with the batch calls
+ */
+static void request_batches(const char *name, int batched) {
+  long ops = 0;
+  int r, i;
+
+  begin();
+  for (r = 0; r < STEPS / BATCH; r++) {
+    if (batched) {
+      simple_malloc_batch(512, BATCH, blocks);
+    } else {
+      for (i = 0; i < BATCH; i++) {
+        blocks[i] = simple_malloc(512);
+      }
+    }
+    if (r == 0) {
+      measure(BATCH, BATCH * 512);
+    }
+    if (batched) {
+      simple_free_batch(blocks, BATCH);
+    } else {
+      for (i = 0; i < BATCH; i++) {
+        simple_free(blocks[i]);
+      }
+    }
+    ops += 2 * BATCH;
+  }
+  end(name, ops);
+}
+
+/*
+ * Keep BLOCKS blocks of 64 B to 2 KB live, about 80 MB, and in each step
+ * update the first and last word of a random one, replacing it by a block
+ * of a new size in every 16th step. The blocks are spread over far more
+ * 4 KB pages than the TLB maps, so with them nearly every step misses it.
+ * The time is per step rather than per call here.
+ */
+static void tlb_walk(void) {
+  size_t requested = 0;
+  int i;
+
+  begin();
+  for (i = 0; i < BLOCKS; i++) {
+    sizes[i] = log_size(6, 11);
+    blocks[i] = simple_malloc(sizes[i]);
+    *(long *) blocks[i] = i;
+    requested += sizes[i];
+  }
+  measure(BLOCKS, requested);
+  t0 = now();
+  for (i = 0; i < STEPS; i++) {
+    int n = rand() % BLOCKS;
+    long *p = blocks[n];
+    p[0]++;
+    p[sizes[n] / sizeof(long) - 1] = p[0];
+    if (i % 16 == 0) {
+      requested -= sizes[n];
+      simple_free(p);
+      sizes[n] = log_size(6, 11);
+      blocks[n] = simple_malloc(sizes[n]);
+      *(long *) blocks[n] = i;
+      requested += sizes[n];
+    }
+  }
+  end("tlb_walk", STEPS);
+  for (i = 0; i < BLOCKS; i++) {
+    simple_free(blocks[i]);
+  }
+}
+
+/* Allocate blocks of 8 B to 4 KB until the heap is full */
+static void exhaustion(void) {
+  void **list = NULL;
+  size_t requested = 0;
+  long count = 0;
+  long ops = 0;
+
+  begin();
+  for (;;) {
+    size_t size = log_size(3, 12);
+    void **p = simple_malloc(size);
+    ops++;
+    if (p == NULL) {
+      break;
+    }
+    /* Blocks are chained through their first word */
+    *p = list;
+    list = p;
+    requested += size;
+    count++;
+  }
+  measure(count, requested);
+  while (list != NULL) {
+    void **next = *list;
+    simple_free(list);
+    list = next;
+    ops++;
+  }
+  end("exhaustion", ops);
+}
+
+/* Does case name run? */
+static int selected(int argc, char **argv, const char *name) {
+  return argc < 2 || strcmp(argv[1], name) == 0;
+}
+
+int main(int argc, char **argv) {
+  setenv("MM_HEAP_MAX", HEAP_MAX, 0);
+  srand(1);
+
+  printf("case,engine,ops,ns_per_op,overhead_bytes\n");
+  if (selected(argc, argv, "small_fixed")) {
+    fill_and_free("small_fixed", 1, 1);
+  }
+  if (selected(argc, argv, "random_sizes")) {
+    random_sizes();
+  }
+  if (selected(argc, argv, "lifo")) {
+    fill_and_free("lifo", 0, 1);
+  }
+  if (selected(argc, argv, "fifo")) {
+    fill_and_free("fifo", 0, 0);
+  }
+  if (selected(argc, argv, "mixed_lifetimes")) {
+    mixed_lifetimes();
+  }
+  if (selected(argc, argv, "node_churn")) {
+    node_churn();
+  }
+  if (selected(argc, argv, "single_requests")) {
+    request_batches("single_requests", 0);
+  }
+  if (selected(argc, argv, "batch_requests")) {
+    request_batches("batch_requests", 1);
+  }
+  if (selected(argc, argv, "tlb_walk")) {
+    tlb_walk();
+  }
+  if (selected(argc, argv, "exhaustion")) {
+    exhaustion();
+  }
+  return 0;
+}
@@ -16,9 +16,17 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200809L   /* rand_r and clock_gettime */
+#define _DEFAULT_SOURCE           /* mincore */
+
+#include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <check.h>
 #include "mm.h"
 
@@ -26,6 +34,11 @@
 #define MALLOC simple_malloc
 #define FREE   simple_free
 
+/* Alignment of every block, 16 when built with make ALIGN=16 as the LD_PRELOAD library is */
+#ifndef MM_ALIGN
+#define MM_ALIGN 8
+#endif
+
 /**
  * @name: Utility function to XOR a block of memory. 
  */
@@ -276,36 +289,1076 @@ START_TEST (test_memory_exerciser)
 
 END_TEST
 
-START_TEST (test_next_fit)
+/**
+ * @name   Threaded stress worker
+ * @brief  Allocate, fill, verify and free blocks of mostly small random sizes.
+ *
+ * Each block is filled with a byte derived from the thread and slot, so a
+ * block handed to two threads at once shows up as corruption.
+ */
+#define STRESS_OPS     100000
+#define STRESS_SLOTS   64
+
+typedef struct {
+  unsigned int seed;
+  int id;
+  int ok;
+} StressArg;
+
+static void * stress_worker(void * arg)
+{
+  StressArg * a = arg;
+  struct {
+    unsigned char *addr;
+    uint32_t size;
+  } slots[STRESS_SLOTS];
+  uint32_t n, i, op;
+
+  memset(slots, 0, sizeof(slots));
+
+  for (op = 0; op < STRESS_OPS; op++) {
+    n = rand_r(&a->seed) % STRESS_SLOTS;
+    unsigned char fill = (unsigned char) (a->id * STRESS_SLOTS + n);
+
+    if (slots[n].addr != NULL) {
+      for (i = 0; i < slots[n].size; i++) {
+        if (slots[n].addr[i] != fill) {
+          a->ok = 0;
+        }
+      }
+      FREE(slots[n].addr);
+    }
+
+    /* Mostly small blocks, with the occasional larger one */
+    slots[n].size = (rand_r(&a->seed) & 15) ? 1 + rand_r(&a->seed) % 256 : 1 + rand_r(&a->seed) % 4096;
+    slots[n].addr = MALLOC(slots[n].size);
+    if (slots[n].addr == NULL) {
+      a->ok = 0;
+      continue;
+    }
+    memset(slots[n].addr, fill, slots[n].size);
+  }
+
+  for (n = 0; n < STRESS_SLOTS; n++) {
+    FREE(slots[n].addr);
+  }
+  return NULL;
+}
+
+
+/**
+ * @name   Threaded stress test
+ * @brief  Run the stress worker on 1, 2, 4 and 8 threads at once.
+ *
+ * Checks that concurrent allocations never overlap, and prints the
+ * throughput for each thread count to show how it scales.
+ */
+START_TEST (test_threaded_stress)
+{
+  pthread_t threads[8];
+  StressArg args[8];
+  struct timespec t0, t1;
+  int nthreads, i;
+
+  for (nthreads = 1; nthreads <= 8; nthreads *= 2) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < nthreads; i++) {
+      args[i].seed = i + 1;
+      args[i].id = i;
+      args[i].ok = 1;
+      pthread_create(&threads[i], NULL, stress_worker, &args[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("Threaded stress: %d threads, %.0f ops/s\n", nthreads, nthreads * STRESS_OPS / seconds);
+
+    for (i = 0; i < nthreads; i++) {
+      ck_assert_msg(args[i].ok, "Thread %d saw a failed allocation or corrupted block\n", i);
+    }
+  }
+}
+END_TEST
+
+
+static pthread_key_t late_key;
+
+/**
+ * @name   Late destructor
+ * @brief  Allocates and frees after the allocator's own destructor has run, as its key is created later.
+ */
+static void late_destructor(void * arg) {
+  void * small = MALLOC(16);
+  void * large = MALLOC(1000);
+
+  FREE(small);
+  FREE(large);
+}
+
+/**
+ * @name   Late worker thread
+ * @brief  Allocates once, and leaves late_destructor to run when it exits.
+ */
+static void * late_worker(void * arg) {
+  FREE(MALLOC(16));
+  pthread_setspecific(late_key, arg);
+  return NULL;
+}
+
+/**
+ * @name   Thread exit unit test
+ * @brief  Tests that memory freed by destructors running after the thread's cleanup is not kept.
+ */
+START_TEST (test_thread_exit)
+{
+  pthread_t thread;
+  size_t in_use;
+  int i;
+
+  FREE(MALLOC(16));
+  ck_assert(pthread_key_create(&late_key, late_destructor) == 0);
+  in_use = simple_mallinfo().in_use;
+
+  // More threads than arenas, so arenas claimed by destructors would run out
+  for (i = 0; i < 20; i++) {
+    pthread_create(&thread, NULL, late_worker, &late_key);
+    pthread_join(thread, NULL);
+  }
+  ck_assert_msg(simple_mallinfo().in_use == in_use, "%zu bytes left in the caches of exited threads\n",
+                simple_mallinfo().in_use - in_use);
+  pthread_key_delete(late_key);
+}
+END_TEST
+
+
+/**
+ * @name   Segregated fit unit test
+ * @brief  Tests whether a freed block is reused by a smaller request.
+ */
+START_TEST (test_segregated_fit)
 {
     void * ptr1;
     void * ptr2;
     void * ptr3;
     void * ptr4;
 
-    // Allocate 3 blocks of 10 integers
-    ptr1 = MALLOC(10 * sizeof(int));
-    ptr2 = MALLOC(10 * sizeof(int));
-    ptr3 = MALLOC(10 * sizeof(int));
+    // Allocate 3 blocks of 100 integers (too large for the thread cache)
+    ptr1 = MALLOC(100 * sizeof(int));
+    ptr2 = MALLOC(100 * sizeof(int));
+    ptr3 = MALLOC(100 * sizeof(int));
 
     // Free the middle block (ptr2)
     FREE(ptr2);
 
-    // Allocate a smaller block (5 integers)
-    ptr4 = MALLOC(5 * sizeof(int));
+    // Allocate a smaller block (75 integers)
+    ptr4 = MALLOC(75 * sizeof(int));
 
-    // In a first-fit strategy, ptr4 would be allocated where ptr2 was.
-    // But in a next-fit strategy, ptr4 should be allocated after ptr3.
+    // The freed block sits in a larger size class than the request, and that
+    // class is searched before the rest of the heap, so ptr4 reuses ptr2's block.
+    ck_assert(ptr4 == ptr2);
 
-    ck_assert(ptr4 != ptr2); // Next-fit should not reuse ptr2
+    // Free all allocated memory
+    FREE(ptr1);
+    FREE(ptr3);
+    FREE(ptr4);
+}
+END_TEST
 
-    // Additional check to see if ptr4 is after ptr3
-    ck_assert(ptr4 > ptr3);
+/**
+ * @name   Search cost unit test
+ * @brief  Tests that a search only visits free blocks on a mostly allocated heap.
+ *
+ * 1000 blocks are allocated and every 10th is freed, leaving the region
+ * 90% allocated. A scan over all block headers would step over about 10 blocks
+ * per allocation; the explicit free lists should need about one.
+ */
+START_TEST (test_search_visits)
+{
+    void * ptrs[1000];
+    size_t visits;
+    int i;
 
-    // Free all allocated memory
+    for (i = 0; i < 1000; i++) {
+        ptrs[i] = MALLOC(512);
+        ck_assert(ptrs[i] != NULL);
+    }
+    for (i = 0; i < 1000; i += 10) {
+        FREE(ptrs[i]);
+    }
+
+    visits = simple_search_visits();
+    for (i = 0; i < 1000; i += 10) {
+        ptrs[i] = MALLOC(512);
+        ck_assert(ptrs[i] != NULL);
+    }
+    visits = simple_search_visits() - visits;
+
+    ck_assert_msg(visits <= 2 * 100, "%zu blocks visited for 100 allocations\n", visits);
+
+    for (i = 0; i < 1000; i++) {
+        FREE(ptrs[i]);
+    }
+}
+END_TEST
+
+/**
+ * @name   Coalescing unit test
+ * @brief  Tests that a freed block merges with free blocks on both sides.
+ */
+START_TEST (test_coalescing)
+{
+#ifdef MM_BUDDY
+    char * guard;
+    char * ptr1;
+    char * ptr2;
+    char * ptr3;
+
+    // Shrinking a block hands its upper half to the head of its bin, so the
+    // next request of that size takes it: ptr1 is guard's buddy, ptr2 is ptr1's.
+    guard = simple_realloc(MALLOC(4000), 2000);
+    ptr1 = simple_realloc(MALLOC(2000), 1000);
+    ptr2 = MALLOC(1000);
+    ck_assert(ptr1 == guard + 2048 && ptr2 == ptr1 + 1024);
+
+    // The buddies merge back into one block, but not with the allocated guard
     FREE(ptr1);
+    FREE(ptr2);
+    ptr3 = MALLOC(2000);
+    ck_assert(ptr3 == ptr1);
+
     FREE(ptr3);
+    FREE(guard);
+#else
+    char * ptr1;
+    char * ptr2;
+    char * ptr3;
+    char * guard;
+    char * ptr4;
+
+    ptr1 = MALLOC(1000);
+    ptr2 = MALLOC(1000);
+    ptr3 = MALLOC(1000);
+    guard = MALLOC(1000);
+    ck_assert(ptr1 + 1000 <= ptr2 && ptr2 + 1000 <= ptr3);
+
+    // Free the outer blocks first, then the middle one
+    FREE(ptr1);
+    FREE(ptr3);
+    FREE(ptr2);
+
+    // All three should now form a single free block. The request leaves some
+    // slack, as the tlsf engine only takes blocks of the next larger class.
+    ptr4 = MALLOC(2900);
+    ck_assert(ptr4 == ptr1);
+
     FREE(ptr4);
+    FREE(guard);
+#endif
+}
+END_TEST
+
+/**
+ * @name   Reallocation unit test
+ * @brief  Tests in-place growth and shrinking, and moving when blocked.
+ */
+START_TEST (test_realloc)
+{
+    char * ptr1;
+    char * ptr2;
+    char * guard;
+    char * ptr3;
+    int i;
+
+#ifdef MM_BUDDY
+    // Cut ptr1 and ptr2 from one block, so ptr2 follows ptr1 (see test_coalescing)
+    ptr1 = simple_realloc(MALLOC(2000), 1000);
+#else
+    ptr1 = MALLOC(1000);
+#endif
+    ptr2 = MALLOC(1000);
+    guard = MALLOC(1000);
+    for (i = 0; i < 1000; i++) {
+        ptr1[i] = (char) i;
+    }
+    ck_assert(simple_usable_size(ptr1) >= 1000);
+
+    // Grow in place into the freed neighbour
+    FREE(ptr2);
+    ptr3 = simple_realloc(ptr1, 2000);
+    ck_assert(ptr3 == ptr1);
+    ck_assert(simple_usable_size(ptr3) >= 2000);
+
+    // Shrink in place
+    ptr3 = simple_realloc(ptr1, 500);
+    ck_assert(ptr3 == ptr1);
+    ck_assert(simple_usable_size(ptr3) >= 500 && simple_usable_size(ptr3) < 2000);
+
+    // Grow beyond the guard, forcing a move
+    ptr3 = simple_realloc(ptr1, 10000);
+    ck_assert(ptr3 != NULL && ptr3 != ptr1);
+    for (i = 0; i < 500; i++) {
+        ck_assert(ptr3[i] == (char) i);
+    }
+
+    FREE(ptr3);
+    FREE(guard);
+}
+END_TEST
+
+/**
+ * @name   Oversized request unit test
+ * @brief  Tests that sizes whose header and rounding would wrap around fail with ENOMEM.
+ */
+START_TEST (test_oversized)
+{
+    char * ptr = MALLOC(16);
+    void * out[4];
+
+    ck_assert(ptr != NULL);
+    strcpy(ptr, "intact");
+
+    errno = 0;
+    ck_assert(MALLOC(SIZE_MAX) == NULL);
+    ck_assert(errno == ENOMEM);
+    ck_assert(MALLOC(SIZE_MAX - 7) == NULL);
+    ck_assert(simple_calloc(1, SIZE_MAX - 3) == NULL);
+    ck_assert(simple_memalign(4096, SIZE_MAX - 100) == NULL);
+    ck_assert(simple_memalign((size_t) 1 << 63, 16) == NULL);
+    ck_assert(simple_malloc_batch(SIZE_MAX - 3, 4, out) == 0);
+
+    // A failed resize leaves the block alone
+    errno = 0;
+    ck_assert(simple_realloc(ptr, SIZE_MAX - 3) == NULL);
+    ck_assert(errno == ENOMEM);
+    ck_assert(simple_usable_size(ptr) >= 16 && strcmp(ptr, "intact") == 0);
+    FREE(ptr);
+}
+END_TEST
+
+/**
+ * @name   Zeroed allocation unit test
+ * @brief  Tests that simple_calloc clears reused memory and rejects overflowing sizes.
+ */
+START_TEST (test_calloc)
+{
+    unsigned char * ptr1;
+    unsigned char * ptr2;
+    unsigned char * blocks[16];
+    unsigned char resident;
+    int fresh = 0;
+    size_t i;
+
+    // Dirty a block and give it back
+    ptr1 = MALLOC(4096);
+    ck_assert(ptr1 != NULL);
+    for (i = 0; i < 4096; i++) {
+        ptr1[i] = 0xff;
+    }
+    FREE(ptr1);
+
+    ptr2 = simple_calloc(64, 64);
+    ck_assert(ptr2 != NULL);
+    for (i = 0; i < 4096; i++) {
+        ck_assert(ptr2[i] == 0);
+    }
+    FREE(ptr2);
+
+    // A large block that mostly comes from never used memory
+    ptr2 = simple_calloc(1024, 1024);
+    ck_assert(ptr2 != NULL);
+    for (i = 0; i < 1024 * 1024; i++) {
+        ck_assert(ptr2[i] == 0);
+    }
+    FREE(ptr2);
+
+    // Heap blocks past the high-water mark are not cleared, so their pages stay untouched
+    for (i = 0; i < 16; i++) {
+        blocks[i] = simple_calloc(900, 1024);
+        ck_assert(blocks[i] != NULL);
+        if (!fresh) {
+            uintptr_t page = ((uintptr_t) blocks[i] + 4095) & ~4095UL;
+            ck_assert(mincore((void *) page, 4096, &resident) == 0);
+            fresh = !(resident & 1);
+        }
+        ck_assert(blocks[i][0] == 0 && blocks[i][450 * 1024] == 0 && blocks[i][900 * 1024 - 1] == 0);
+    }
+#ifdef MM_BUDDY
+    // The buddy engine writes a header into every buddy the heap is cut into, so it always clears
+    ck_assert_msg(!fresh, "calloc left never used memory untouched\n");
+#else
+    // Huge pages are faulted in whole or taken up front, so only 4 KB pages tell
+    ck_assert_msg(fresh || memory_huge != HUGE_NONE, "calloc cleared never used memory\n");
+#endif
+
+    // Next to them, the tail split off a dirtied block is dirty too
+    ptr1 = MALLOC(100000);
+    ck_assert(ptr1 != NULL);
+    memset(ptr1, 0xff, 100000);
+    FREE(ptr1);
+    ptr2 = simple_calloc(1, 300000);
+    ck_assert(ptr2 != NULL);
+    for (i = 0; i < 300000; i++) {
+        ck_assert_msg(ptr2[i] == 0, "Byte %zu not cleared\n", i);
+    }
+    FREE(ptr2);
+    for (i = 0; i < 16; i++) {
+        FREE(blocks[i]);
+    }
+
+    ck_assert(simple_calloc(SIZE_MAX / 2, 3) == NULL);
+}
+END_TEST
+
+/**
+ * @name   Object pool unit test
+ * @brief  Tests that pool objects are aligned, distinct and reused after free.
+ */
+START_TEST (test_pool)
+{
+    Pool * pool = simple_pool_create(12);
+    char * objs[1000];
+    int i;
+
+    ck_assert(pool != NULL);
+    for (i = 0; i < 1000; i++) {
+        objs[i] = simple_pool_alloc(pool);
+        ck_assert(objs[i] != NULL);
+        ck_assert(((uintptr_t) objs[i] & 0x07) == 0);
+        objs[i][0] = (char) i;
+        objs[i][11] = (char) i;
+    }
+    for (i = 0; i < 1000; i++) {
+        ck_assert(objs[i][0] == (char) i && objs[i][11] == (char) i);
+    }
+
+    // A freed object is handed out again
+    simple_pool_free(pool, objs[500]);
+    ck_assert(simple_pool_alloc(pool) == objs[500]);
+
+    simple_pool_destroy(pool);
+}
+END_TEST
+
+/**
+ * @name   Region unit test
+ * @brief  Tests bump allocation, resetting to a mark and oversized requests.
+ */
+START_TEST (test_region)
+{
+    Region * region = simple_region_create();
+    RegionMark mark;
+    char * ptr1;
+    char * ptr2;
+    char * big;
+    int i;
+
+    ck_assert(region != NULL);
+    for (i = 0; i < 10000; i++) {
+        ptr1 = simple_region_alloc(region, 1 + i % 100);
+        ck_assert(ptr1 != NULL);
+        ck_assert(((uintptr_t) ptr1 & 0x07) == 0);
+    }
+
+    // Everything after the mark is released by the reset
+    mark = simple_region_mark(region);
+    ptr1 = simple_region_alloc(region, 24);
+    big = simple_region_alloc(region, 1024 * 1024);
+    ck_assert(big != NULL);
+    big[1024 * 1024 - 1] = 1;
+    for (i = 0; i < 10000; i++) {
+        ck_assert(simple_region_alloc(region, 100) != NULL);
+    }
+    simple_region_reset(region, mark);
+    ptr2 = simple_region_alloc(region, 24);
+    ck_assert(ptr2 == ptr1);
+
+    simple_region_destroy(region);
+}
+END_TEST
+
+/**
+ * @name   Heap growth unit test
+ * @brief  Tests that the heap grows past its initial 32 MB, and that very large blocks work.
+ */
+START_TEST (test_heap_growth)
+{
+    char * ptrs[100];
+    char * big;
+    int i;
+
+    // 50 MB in blocks below the threshold for separate mappings
+    for (i = 0; i < 100; i++) {
+        ptrs[i] = MALLOC(512 * 1024);
+        ck_assert_msg(ptrs[i] != NULL, "Allocation %d failed\n", i);
+        ptrs[i][0] = (char) i;
+        ptrs[i][512 * 1024 - 1] = (char) i;
+    }
+    for (i = 0; i < 100; i++) {
+        ck_assert(ptrs[i][0] == (char) i && ptrs[i][512 * 1024 - 1] == (char) i);
+        FREE(ptrs[i]);
+    }
+
+    // A block with a mapping of its own, grown with realloc
+    big = simple_calloc(64, 1024 * 1024);
+    ck_assert(big != NULL);
+    ck_assert(((uintptr_t) big & 0x07) == 0);
+    ck_assert(big[0] == 0 && big[64 * 1024 * 1024 - 1] == 0);
+    big[0] = 1;
+    big = simple_realloc(big, 128 * 1024 * 1024);
+    ck_assert(big != NULL && big[0] == 1);
+    ck_assert(simple_usable_size(big) >= 128 * 1024 * 1024);
+    FREE(big);
+}
+END_TEST
+
+/**
+ * @name   Aligned allocation unit test
+ * @brief  Tests alignments from 16 bytes to a page, in the heap and in separate mappings, and MM_ALIGN for plain allocations.
+ */
+START_TEST (test_memalign)
+{
+    char * ptrs[9];
+    char * small[64];
+    char * big;
+    size_t alignment;
+    int i;
+
+    for (i = 0, alignment = 16; alignment <= 4096; i++, alignment *= 2) {
+        ptrs[i] = simple_memalign(alignment, 1000);
+        ck_assert(ptrs[i] != NULL);
+        ck_assert_msg(((uintptr_t) ptrs[i] & (alignment - 1)) == 0, "%p not aligned to %zu\n", ptrs[i], alignment);
+        ptrs[i][0] = 1;
+        ptrs[i][999] = 1;
+    }
+    errno = 0;
+    ck_assert(simple_memalign(24, 100) == NULL && errno == EINVAL);
+    errno = 0;
+    ck_assert(simple_aligned_alloc(0, 100) == NULL && errno == EINVAL);
+
+    // Blocks of odd multiples of 8 bytes make some candidates start 8 bytes past a multiple of 16
+    for (i = 0; i < 64; i++) {
+        small[i] = simple_memalign(16, 296 + 8 * (i % 3));
+        ck_assert(small[i] != NULL);
+        ck_assert(((uintptr_t) small[i] & 15) == 0);
+        memset(small[i], i, 296);
+    }
+    for (i = 63; i >= 0; i--) {
+        ck_assert(small[i][0] == (char) i && small[i][295] == (char) i);
+        FREE(small[i]);
+    }
+
+    // Aligned blocks can be resized and freed as usual
+    ptrs[0] = simple_realloc(ptrs[0], 5000);
+    ck_assert(ptrs[0] != NULL && ptrs[0][0] == 1);
+    for (i = 0; i < 9; i++) {
+        FREE(ptrs[i]);
+    }
+
+    big = simple_aligned_alloc(64 * 1024, 4 * 1024 * 1024);
+    ck_assert(big != NULL);
+    ck_assert(((uintptr_t) big & (64 * 1024 - 1)) == 0);
+    big[4 * 1024 * 1024 - 1] = 1;
+    big = simple_realloc(big, 8 * 1024 * 1024);
+    ck_assert(big != NULL && big[4 * 1024 * 1024 - 1] == 1);
+    FREE(big);
+
+    // Plain allocations of every size are MM_ALIGN aligned, from runs, caches, heaps and mappings
+    for (i = 0; i < 64; i++) {
+        size_t size = i * 37 + (i % 4 == 3 ? (size_t) i << 16 : 0);
+        small[i] = i % 2 ? MALLOC(size) : simple_calloc(1, size);
+        ck_assert_msg(small[i] != NULL && ((uintptr_t) small[i] & (MM_ALIGN - 1)) == 0, "%p for %zu bytes\n", small[i], size);
+        small[i] = simple_realloc(small[i], size + 100);
+        ck_assert(small[i] != NULL && ((uintptr_t) small[i] & (MM_ALIGN - 1)) == 0);
+    }
+    for (i = 0; i < 64; i++) {
+        FREE(small[i]);
+    }
+    big = MALLOC(2 * 1024 * 1024);
+    ck_assert(big != NULL && ((uintptr_t) big & (MM_ALIGN - 1)) == 0);
+    FREE(big);
+}
+END_TEST
+
+/**
+ * @name   Heap statistics unit test
+ * @brief  Tests that simple_mallinfo follows allocations and frees.
+ */
+START_TEST (test_mallinfo)
+{
+    MallocInfo before;
+    MallocInfo info;
+    size_t histogram;
+    void * ptr;
+    int i;
+
+    before = simple_mallinfo();
+    ptr = MALLOC(5000);
+    ck_assert(ptr != NULL);
+    info = simple_mallinfo();
+    ck_assert(info.mallocs == before.mallocs + 1);
+    ck_assert(info.in_use >= before.in_use + 5000);
+    ck_assert(info.peak_in_use >= info.in_use);
+    ck_assert(info.free_blocks > 0 && info.largest_free <= info.free);
+    ck_assert(info.fragmentation >= 0.0 && info.fragmentation < 1.0);
+
+    // Every search lands in one bucket of the histogram
+    histogram = 0;
+    for (i = 0; i < MALLOC_SEARCH_BUCKETS; i++) {
+        histogram += info.search_histogram[i] - before.search_histogram[i];
+    }
+    ck_assert(histogram == 1);
+
+    FREE(ptr);
+    info = simple_mallinfo();
+    ck_assert(info.frees == before.frees + 1);
+    ck_assert(info.in_use == before.in_use);
+
+    ck_assert(simple_calloc((size_t) 1 << 40, (size_t) 1 << 40) == NULL);
+    ck_assert(simple_mallinfo().failed == before.failed + 1);
+}
+END_TEST
+
+/**
+ * @name   Ownership unit test
+ * @brief  Tests that simple_owns tells our blocks from memory allocated elsewhere.
+ */
+START_TEST (test_owns)
+{
+    char * small;
+    char * big;
+    char * other;
+    char local;
+
+    small = MALLOC(100);
+    big = MALLOC(2 * 1024 * 1024);
+    other = malloc(100);
+    ck_assert(small != NULL && big != NULL && other != NULL);
+
+    ck_assert(simple_owns(small));
+    ck_assert(simple_owns(big));
+    ck_assert(!simple_owns(other));
+    ck_assert(!simple_owns(&local));
+    ck_assert(!simple_owns(big + 16));
+
+    // Freeing memory from elsewhere leaves it alone
+    simple_free(other);
+    free(other);
+
+    FREE(big);
+    ck_assert(!simple_owns(big));
+    FREE(small);
+}
+END_TEST
+
+/**
+ * @name   Batch owner thread
+ * @brief  Allocates adjacent blocks in its own arena for another thread to free.
+ */
+static void * batch_owner(void * arg) {
+  void ** ptrs = arg;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    ptrs[i] = MALLOC(1000);
+  }
+  return NULL;
+}
+
+/**
+ * @name   Batch unit test
+ * @brief  Tests allocating and freeing blocks in batches, mixed with single blocks.
+ */
+START_TEST (test_batch)
+{
+    void * ptrs[200];
+    pthread_t thread;
+    MallocInfo before;
+    MallocInfo info;
+    size_t n;
+    int i, j;
+
+    before = simple_mallinfo();
+    n = simple_malloc_batch(100, 200, ptrs);
+    ck_assert(n == 200);
+    for (i = 0; i < 200; i++) {
+        ck_assert(ptrs[i] != NULL && simple_usable_size(ptrs[i]) >= 100);
+        memset(ptrs[i], i, 100);
+    }
+    // The blocks do not overlap
+    for (i = 0; i < 200; i++) {
+        for (j = 0; j < 100; j++) {
+            ck_assert(((unsigned char *) ptrs[i])[j] == i);
+        }
+    }
+    info = simple_mallinfo();
+    ck_assert(info.mallocs == before.mallocs + 200);
+    ck_assert(info.in_use >= before.in_use + 200 * 100);
+
+    // Free one block on its own, and the others in a shuffled batch with a repeat and NULL
+    FREE(ptrs[7]);
+    ptrs[7] = NULL;
+    for (i = 0; i < 200; i++) {
+        void * tmp = ptrs[i];
+        j = rand() % 200;
+        ptrs[i] = ptrs[j];
+        ptrs[j] = tmp;
+    }
+    ptrs[0] = ptrs[0] == NULL ? ptrs[1] : ptrs[0];
+    simple_free_batch(ptrs, 200);
+    info = simple_mallinfo();
+    ck_assert(info.frees == before.frees + 200);
+    ck_assert(info.in_use == before.in_use);
+
+    // Large blocks get mappings of their own
+    ck_assert(simple_malloc_batch(2 * 1024 * 1024, 3, ptrs) == 3);
+    ((char *) ptrs[2])[2 * 1024 * 1024 - 1] = 1;
+    simple_free_batch(ptrs, 3);
+    ck_assert(simple_mallinfo().in_use == before.in_use);
+
+    // Adjacent blocks of another thread's arena are handed to it one by one, their headers untouched
+    pthread_create(&thread, NULL, batch_owner, ptrs);
+    pthread_join(thread, NULL);
+    for (i = 0; i < 4; i++) {
+        ck_assert(ptrs[i] != NULL && simple_usable_size(ptrs[i]) < 2000);
+    }
+    simple_free_batch(ptrs, 4);
+    for (i = 0; i < 4; i++) {
+        ck_assert_msg(simple_usable_size(ptrs[i]) < 2000, "Block %p of the other arena was merged\n", ptrs[i]);
+    }
+}
+END_TEST
+
+/**
+ * @name   Small object unit test
+ * @brief  Tests that small requests are packed into runs without headers, and leave them when they grow.
+ */
+START_TEST (test_runs)
+{
+    char * nodes[300];
+    char * ptr;
+    int packed = 0;
+    int i;
+
+    for (i = 0; i < 300; i++) {
+        nodes[i] = MALLOC(16);
+        ck_assert(nodes[i] != NULL);
+        ck_assert(simple_usable_size(nodes[i]) == 16);
+        memset(nodes[i], i, 16);
+    }
+    // Most nodes directly follow another one
+    for (i = 1; i < 300; i++) {
+        packed += nodes[i] == nodes[i - 1] + 16;
+    }
+    ck_assert_msg(packed > 250, "only %d of 300 nodes packed\n", packed);
+    for (i = 0; i < 300; i++) {
+        ck_assert(nodes[i][0] == (char) i && nodes[i][15] == (char) i);
+    }
+
+    // Growing beyond the class moves the object, shrinking keeps it
+    ck_assert(simple_realloc(nodes[5], 10) == nodes[5]);
+    ptr = simple_realloc(nodes[5], 1000);
+    ck_assert(ptr != NULL && ptr[0] == 5 && ptr[15] == 5);
+    FREE(ptr);
+    nodes[5] = NULL;
+
+    ptr = simple_calloc(3, 40);
+    ck_assert(ptr != NULL && ptr[0] == 0 && ptr[119] == 0);
+    FREE(ptr);
+
+    // Objects of more than 8 bytes are 16-byte aligned, whatever their class
+    for (i = 9; i <= 128; i++) {
+        ptr = MALLOC(i);
+        ck_assert_msg(ptr != NULL && ((uintptr_t) ptr & 15) == 0, "%p for %d bytes\n", ptr, i);
+        FREE(ptr);
+    }
+
+    for (i = 0; i < 300; i++) {
+        FREE(nodes[i]);
+    }
+}
+END_TEST
+
+/**
+ * @name   Double free unit test
+ * @brief  Tests that freeing a block twice does not let it be handed out twice, wherever the first free put it.
+ */
+START_TEST (test_double_free)
+{
+    size_t sizes[] = { 8, 100, 200, 1000 };
+    char * ptrs[64];
+    char * ptr;
+    int i, j, k;
+
+    for (k = 0; k < 4; k++) {
+        // Into the thread cache (or the heap for the largest size), then again
+        ptr = MALLOC(sizes[k]);
+        ck_assert(ptr != NULL);
+        FREE(ptr);
+        FREE(ptr);
+        for (i = 0; i < 64; i++) {
+            ptrs[i] = MALLOC(sizes[k]);
+            for (j = 0; j < i; j++) {
+                ck_assert_msg(ptrs[i] != ptrs[j], "%p of %zu bytes handed out twice\n", ptrs[i], sizes[k]);
+            }
+        }
+        for (i = 0; i < 64; i++) {
+            FREE(ptrs[i]);
+        }
+
+        // Back to its run or heap by a batch, then again on its own and in a batch
+        ptr = MALLOC(sizes[k]);
+        simple_free_batch((void **) &ptr, 1);
+        FREE(ptr);
+        simple_free_batch((void **) &ptr, 1);
+        for (i = 0; i < 64; i++) {
+            ptrs[i] = MALLOC(sizes[k]);
+            for (j = 0; j < i; j++) {
+                ck_assert_msg(ptrs[i] != ptrs[j], "%p of %zu bytes handed out twice\n", ptrs[i], sizes[k]);
+            }
+        }
+        for (i = 0; i < 64; i++) {
+            FREE(ptrs[i]);
+        }
+    }
+}
+END_TEST
+
+/**
+ * @name   Trim unit test
+ * @brief  Tests that the pages of large free blocks are given back and fault back in on reuse,
+ *         also for free blocks far smaller than the heap, and that hugetlbfs pages are kept.
+ */
+START_TEST (test_trim)
+{
+    char * ptrs[72];
+    MallocInfo before;
+    MallocInfo after;
+    uintptr_t end;
+    int huge = memory_huge == HUGE_TLB;   // hugetlbfs pages are kept, see mm.c
+    int i;
+
+    // Blocks below the mapping threshold merge into a free block above the trim threshold
+    for (i = 0; i < 72; i++) {
+        ptrs[i] = MALLOC(512 * 1024);
+        ck_assert(ptrs[i] != NULL);
+        memset(ptrs[i], 1, 512 * 1024);
+    }
+    before = simple_mallinfo();
+    for (i = 0; i < 72; i++) {
+        FREE(ptrs[i]);
+    }
+    after = simple_mallinfo();
+    ck_assert_msg(huge ? after.released == before.released : after.released >= before.released + 4 * 1024 * 1024,
+                  "%zu bytes released\n", after.released - before.released);
+
+    // The pages are usable again
+    ptrs[0] = MALLOC(1024 * 1024 - 4096);
+    ck_assert(ptrs[0] != NULL);
+    memset(ptrs[0], 2, 1024 * 1024 - 4096);
+    ck_assert(ptrs[0][0] == 2 && ptrs[0][1024 * 1024 - 4097] == 2);
+
+    // Smaller free blocks are only given back on request, and then nothing resident is left
+    FREE(ptrs[0]);
+    ck_assert(huge ? simple_trim() == 0 : simple_trim() > 0);
+    ck_assert(simple_trim() == 0);
+
+    // A free block far smaller than the heap is trimmed as well, with the heap not growing
+    end = memory_end;
+    for (i = 0; i < 14; i++) {
+        ptrs[i] = MALLOC(512 * 1024);
+        ck_assert(ptrs[i] != NULL);
+        memset(ptrs[i], 1, 512 * 1024);
+    }
+    before = simple_mallinfo();
+    for (i = 1; i < 13; i++) {
+        FREE(ptrs[i]);
+    }
+    after = simple_mallinfo();
+    ck_assert_msg(huge ? after.released == before.released : after.released >= before.released + 1024 * 1024,
+                  "%zu bytes released\n", after.released - before.released);
+    ck_assert(memory_end == end);
+
+    // The whole trimmed range is written again
+    simple_trim();
+    for (i = 1; i < 13; i++) {
+        ptrs[i] = MALLOC(512 * 1024);
+        ck_assert(ptrs[i] != NULL);
+        memset(ptrs[i], 3, 512 * 1024);
+        ck_assert(ptrs[i][0] == 3 && ptrs[i][512 * 1024 - 1] == 3);
+    }
+    for (i = 0; i < 14; i++) {
+        FREE(ptrs[i]);
+    }
+}
+END_TEST
+
+/**
+ * @name   Huge page unit test
+ * @brief  Tests that the heap is laid out in whole pages of the size backing it.
+ */
+START_TEST (test_huge_pages)
+{
+    void * ptr = MALLOC(64);
+
+    // The backing is fixed once the heap is set up, in whatever pages it got
+    ck_assert(ptr != NULL);
+    ck_assert(simple_set_huge_pages(1) == -1);
+    ck_assert(memory_huge == HUGE_NONE || memory_page == 2 * 1024 * 1024);
+    ck_assert(memory_start % memory_page == 0);
+    ck_assert(memory_end % memory_page == 0);
+    ck_assert(memory_limit % memory_page == 0);
+    FREE(ptr);
+}
+END_TEST
+
+/**
+ * @name   Heap handle worker
+ * @brief  Allocate, fill, verify and free blocks in one heap of its own.
+ */
+typedef struct {
+  Heap * heap;
+  int ok;
+} HeapArg;
+
+static void * heap_worker(void * arg)
+{
+  HeapArg * a = arg;
+  unsigned char * ptrs[16] = { NULL };
+  unsigned int seed = (uintptr_t) a->heap;
+  int op, n;
+
+  for (op = 0; op < STRESS_OPS; op++) {
+    n = op % 16;
+    if (ptrs[n] != NULL) {
+      if (ptrs[n][0] != n || ptrs[n][99] != n) {
+        a->ok = 0;
+      }
+      simple_heap_free(a->heap, ptrs[n]);
+    }
+    ptrs[n] = simple_heap_malloc(a->heap, 100 + rand_r(&seed) % 4000);
+    if (ptrs[n] == NULL) {
+      a->ok = 0;
+      continue;
+    }
+    ptrs[n][0] = n;
+    ptrs[n][99] = n;
+  }
+  for (n = 0; n < 16; n++) {
+    simple_heap_free(a->heap, ptrs[n]);
+  }
+  return NULL;
+}
+
+/**
+ * @name   Heap handle unit test
+ * @brief  Tests that heaps over separate buffers are independent of each other and of the default heap,
+ *         and leave their buffers' pages alone.
+ */
+START_TEST (test_heap_handles)
+{
+    static uint64_t buffers[2][128 * 1024];   // 1 MB each
+    static uint64_t small[8];
+    Heap * heaps[2];
+    HeapArg args[2];
+    pthread_t threads[2];
+    char * ptrs[2][100];
+    void ** list = NULL;
+    void * ptr;
+    char * big;
+    size_t released;
+    int i, j;
+
+    ck_assert(simple_heap_create(small, sizeof(small)) == NULL);
+    for (j = 0; j < 2; j++) {
+        heaps[j] = simple_heap_create(buffers[j], sizeof(buffers[j]));
+        ck_assert(heaps[j] != NULL);
+    }
+
+    // Blocks come from the buffer of their own heap
+    for (i = 0; i < 100; i++) {
+        for (j = 0; j < 2; j++) {
+            ptrs[j][i] = simple_heap_malloc(heaps[j], 1 + i * 37);
+            ck_assert(ptrs[j][i] != NULL);
+            ck_assert(((uintptr_t) ptrs[j][i] & 0x07) == 0);
+            ck_assert((uintptr_t) ptrs[j][i] >= (uintptr_t) buffers[j]
+                      && (uintptr_t) ptrs[j][i] + 1 + i * 37 <= (uintptr_t) (buffers[j] + 128 * 1024));
+            memset(ptrs[j][i], j + 1, 1 + i * 37);
+        }
+    }
+
+    // Filling one heap leaves the other one alone, and pointers of one are ignored by the other
+    while ((ptr = simple_heap_malloc(heaps[0], 4096)) != NULL) {
+        *(void **) ptr = list;
+        list = ptr;
+    }
+    ck_assert(list != NULL);
+    ptr = simple_heap_malloc(heaps[1], 4096);
+    ck_assert(ptr != NULL);
+    simple_heap_free(heaps[1], ptr);
+    simple_heap_free(heaps[1], ptrs[0][50]);
+    ck_assert(simple_heap_malloc(heaps[0], 4096) == NULL);
+    for (i = 0; i < 100; i++) {
+        for (j = 0; j < 2; j++) {
+            ck_assert(ptrs[j][i][0] == j + 1 && ptrs[j][i][i * 37] == j + 1);
+        }
+    }
+
+    // Freed blocks merge again
+    while (list != NULL) {
+        void ** next = *list;
+        simple_heap_free(heaps[0], list);
+        list = next;
+    }
+    for (i = 0; i < 100; i++) {
+        simple_heap_free(heaps[0], ptrs[0][i]);
+        simple_heap_free(heaps[1], ptrs[1][i]);
+    }
+    ptr = simple_heap_malloc(heaps[0], 300 * 1024);
+    ck_assert(ptr != NULL);
+    simple_heap_free(heaps[0], ptr);
+
+    // Threads using heaps of their own do not get in each other's way
+    for (j = 0; j < 2; j++) {
+        args[j].heap = heaps[j];
+        args[j].ok = 1;
+        pthread_create(&threads[j], NULL, heap_worker, &args[j]);
+    }
+    for (j = 0; j < 2; j++) {
+        pthread_join(threads[j], NULL);
+        ck_assert_msg(args[j].ok, "Heap %d saw a failed allocation or corrupted block\n", j);
+        simple_heap_destroy(heaps[j]);
+    }
+
+    // The caller's buffer is not trimmed: a large freed block keeps its contents
+    big = mmap(NULL, 128 * 1024 * 1024, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ck_assert(big != MAP_FAILED);
+    heaps[0] = simple_heap_create(big, 128 * 1024 * 1024);
+    ck_assert(heaps[0] != NULL);
+    released = simple_mallinfo().released;
+    ptr = simple_heap_malloc(heaps[0], 40 * 1024 * 1024);
+    ck_assert(ptr != NULL);
+    memset(ptr, 1, 40 * 1024 * 1024);
+    simple_heap_free(heaps[0], ptr);
+    ck_assert(((char *) ptr)[20 * 1024 * 1024] == 1 && ((char *) ptr)[40 * 1024 * 1024 - 4096] == 1);
+    ck_assert(simple_mallinfo().released == released);
+    simple_heap_destroy(heaps[0]);
+    munmap(big, 128 * 1024 * 1024);
+
+#ifdef MM_COMPACT
+    // Compact headers cannot span a buffer of 2 GB
+    big = mmap(NULL, 3UL << 30, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ck_assert(big != MAP_FAILED);
+    ck_assert(simple_heap_create(big, 3UL << 30) == NULL);
+    munmap(big, 3UL << 30);
+#endif
+
+    // The default heap is the one behind simple_malloc
+    ptr = simple_heap_malloc(simple_heap_default(), 100);
+    ck_assert(ptr != NULL && simple_owns(ptr));
+    simple_heap_free(simple_heap_default(), ptr);
 }
 END_TEST
 
@@ -326,7 +1379,26 @@ Suite* simple_malloc_suite()
   tcase_add_test (tc_core, test_simple_allocation);
   tcase_add_test (tc_core, test_simple_unique_addresses);
   tcase_add_test (tc_core, test_memory_exerciser);
-  tcase_add_test (tc_core, test_next_fit);
+  tcase_add_test (tc_core, test_threaded_stress);
+  tcase_add_test (tc_core, test_thread_exit);
+  tcase_add_test (tc_core, test_segregated_fit);
+  tcase_add_test (tc_core, test_search_visits);
+  tcase_add_test (tc_core, test_coalescing);
+  tcase_add_test (tc_core, test_realloc);
+  tcase_add_test (tc_core, test_oversized);
+  tcase_add_test (tc_core, test_calloc);
+  tcase_add_test (tc_core, test_pool);
+  tcase_add_test (tc_core, test_region);
+  tcase_add_test (tc_core, test_heap_growth);
+  tcase_add_test (tc_core, test_memalign);
+  tcase_add_test (tc_core, test_mallinfo);
+  tcase_add_test (tc_core, test_owns);
+  tcase_add_test (tc_core, test_batch);
+  tcase_add_test (tc_core, test_runs);
+  tcase_add_test (tc_core, test_double_free);
+  tcase_add_test (tc_core, test_trim);
+  tcase_add_test (tc_core, test_huge_pages);
+  tcase_add_test (tc_core, test_heap_handles);
 
   suite_add_tcase(s, tc_core);
   return s;
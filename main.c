@@ -9,6 +9,9 @@
 char SEP[] = ", ";
 char END[] = ";\n";
 
+/* All intNodes are allocated from this pool */
+static Pool *node_pool = NULL;
+
 /**
  * @name  main
  * @brief This function is the entry point to your program
@@ -24,6 +27,10 @@ main() {
     char command;
     intNode *collection = NULL;
     int flag = 1;
+    node_pool = simple_pool_create(sizeof(intNode));
+    if (node_pool == NULL) {
+        return 1;
+    }
     // Read through commands
     while (flag) {
         command = read_char();
@@ -48,6 +55,7 @@ main() {
 
     // Free memory allocated for collection
     free_list(&collection);
+    simple_pool_destroy(node_pool);
 
     return 0;
 }
@@ -62,7 +70,10 @@ main() {
 int
 add_int(intNode **collection, int count) {
     // Allocate memory for new intNode and set values
-    intNode *new_int = (intNode *)simple_malloc(sizeof(intNode));
+    intNode *new_int = (intNode *)simple_pool_alloc(node_pool);
+    if (new_int == NULL) {
+        return -1;
+    }
     new_int->value = count;
     new_int->next = NULL;
     // Add new intNode to collection tail
@@ -104,7 +115,7 @@ remove_last(intNode **collection) {
         *collection = NULL;
     }
 
-    simple_free(temp);
+    simple_pool_free(node_pool, temp);
     return 0;
 }
 
@@ -146,7 +157,7 @@ free_list(intNode **collection) {
     intNode *next = NULL;
     while(temp != NULL) {
         next = temp->next;
-        simple_free(temp);
+        simple_pool_free(node_pool, temp);
         temp = next;
     }
     return 0;
@@ -1,21 +1,360 @@
+
+
 /**
- * @file   mm.c
+ * @file   memory_setup.c
  * @Author 02335 team
  * @date   September, 2024
  * @brief  Memory management skeleton.
  * 
-* This file contains low level initialization of memory. You should
- * not need to edit this file as part of the assignment.
+ * This file contains low level initialization of memory.
+ *
+ * The heap lives in one range of address space reserved with mmap. Only the
+ * first part of it, the initial heap size, is made accessible at startup;
+ * memory_grow makes further segments accessible directly after it, so the
+ * heap can grow without moving. Very large blocks get mappings of their own
+ * through memory_map.
+ *
+ * The initial size can be set with simple_set_heap_size before the first
+ * allocation, or with the MM_HEAP_SIZE environment variable (in bytes, with
+ * an optional K, M or G suffix). MM_HEAP_MAX sets the size of the reserved
+ * range, which bounds how far the heap can grow.
+ *
+ * With simple_set_huge_pages, or MM_HUGE_PAGES=1, the heap is backed by 2 MB
+ * pages, so random accesses across it miss the TLB far less often. The heap
+ * then takes hugetlbfs pages from the system's pool if it holds enough for
+ * the initial heap, and more as the heap grows, which fails when the pool
+ * runs out. Otherwise the range is aligned to 2 MB and advised for
+ * transparent huge pages. Where neither is available the heap keeps 4 KB
+ * pages. Either way the heap sizes are rounded to 2 MB, and the heap grows
+ * and gives pages back in whole 2 MB pages. memory_huge tells what it got.
  *
  */
 
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "mm.h"
 
 #define ALLOCATE_SIZE    32*1024*1024                 // 32 MB
-#define SKEW_SIZE        10
+#define RESERVE_SIZE     (1UL << 30)                  // 1 GB
+#define PAGE_SIZE        4096
+#define HUGE_PAGE_SIZE   (2*1024*1024)                // 2 MB
+#define COMPACT_MAX      ((1UL << 31) - HUGE_PAGE_SIZE)   // Largest heap compact headers can span
+#define THP_SETTING      "/sys/kernel/mm/transparent_hugepage/enabled"
+
+uintptr_t memory_start = 0;
+uintptr_t memory_end   = 0;
+uintptr_t memory_limit = 0;
+size_t memory_page     = PAGE_SIZE;
+int memory_huge        = HUGE_NONE;
+
+static size_t heap_size = ALLOCATE_SIZE;
+static size_t heap_max  = RESERVE_SIZE;
+static int huge_pages   = 0;
+
+
+/**
+ * @name    parse_size
+ * @brief   Parse a size with an optional K, M or G suffix, returning 0 if invalid
+ */
+static size_t parse_size(const char * s) {
+    char * end;
+    size_t size = strtoull(s, &end, 10);
+
+    switch (*end) {
+        case 'G': case 'g': size <<= 10; /* fall through */
+        case 'M': case 'm': size <<= 10; /* fall through */
+        case 'K': case 'k': size <<= 10; end++; break;
+        case '\0': break;
+        default: return 0;
+    }
+    return *end == '\0' ? size : 0;
+}
+
+
+/**
+ * @name    page_round
+ * @brief   Round size up to a whole number of pages
+ */
+static inline size_t page_round(size_t size) {
+    return (size + PAGE_SIZE - 1) & ~((size_t) PAGE_SIZE - 1);
+}
+
+
+/**
+ * @name    heap_round
+ * @brief   Round size up to a whole number of the pages backing the heap
+ */
+static inline size_t heap_round(size_t size) {
+    return (size + memory_page - 1) & ~(memory_page - 1);
+}
+
+
+/**
+ * @name    simple_set_heap_size
+ * @brief   Set the initial heap size. Only possible before the first allocation.
+ * @retval  0 if ok, -1 if the heap is already set up
+ */
+int simple_set_heap_size(size_t size) {
+    if (memory_start != 0) {
+        return -1;
+    }
+    heap_size = size;
+    return 0;
+}
+
+
+/**
+ * @name    simple_set_huge_pages
+ * @brief   Back the heap with 2 MB pages (on = 1) or not (on = 0). Only possible before the first allocation.
+ * @retval  0 if ok, -1 if the heap is already set up
+ */
+int simple_set_huge_pages(int on) {
+    if (memory_start != 0) {
+        return -1;
+    }
+    huge_pages = on;
+    return 0;
+}
+
+
+/**
+ * @name    thp_enabled
+ * @brief   Does the system give transparent huge pages to ranges advised with MADV_HUGEPAGE?
+ *
+ * Reads the setting with plain system calls, as stdio would allocate.
+ */
+static int thp_enabled(void) {
+    char setting[64] = "";
+    int fd = open(THP_SETTING, O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+    if (read(fd, setting, sizeof(setting) - 1) < 0) {
+        setting[0] = '\0';
+    }
+    close(fd);
+    return strstr(setting, "[always]") != NULL || strstr(setting, "[madvise]") != NULL;
+}
+
+
+/**
+ * @name    huge_populate
+ * @brief   Take the hugetlbfs pages of a range that has just been made accessible
+ * @retval  0 if ok, -1 if the pool is too small (the range is then inaccessible again)
+ *
+ * The range is reserved with MAP_NORESERVE, so the pool need only hold the
+ * pages the heap uses. They are taken up front, as touching a page the pool
+ * cannot supply raises SIGBUS rather than failing.
+ */
+static int huge_populate(uintptr_t start, size_t size) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise((void *) start, size, MADV_POPULATE_WRITE) == 0) {
+        return 0;
+    }
+#endif
+    madvise((void *) start, size, MADV_DONTNEED);
+    mprotect((void *) start, size, PROT_NONE);
+    return -1;
+}
+
+
+/**
+ * @name    reserve_huge
+ * @brief   Reserve size bytes backed by 2 MB pages, the first initial bytes accessible, setting memory_huge to what was used
+ * @retval  Start of the range, or MAP_FAILED if not possible
+ *
+ * Only the hugetlbfs pages of the initial part are taken from the pool, see
+ * huge_populate. If it cannot supply them, the range is cut out of a larger
+ * one at a 2 MB boundary and advised for transparent huge pages instead.
+ */
+static void * reserve_huge(size_t size, size_t initial) {
+    uintptr_t base, start;
+    void * p;
+
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_NORESERVE, -1, 0);
+    if (p != MAP_FAILED) {
+        if (mprotect(p, initial, PROT_READ | PROT_WRITE) == 0 && huge_populate((uintptr_t) p, initial) == 0) {
+            memory_huge = HUGE_TLB;
+            return p;
+        }
+        munmap(p, size);
+    }
+#endif
+    p = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        return p;
+    }
+    base = (uintptr_t) p;
+    start = (base + HUGE_PAGE_SIZE - 1) & ~((uintptr_t) HUGE_PAGE_SIZE - 1);
+    if (start > base) {
+        munmap(p, start - base);
+    }
+    munmap((void *) (start + size), base + HUGE_PAGE_SIZE - start);
+    if (thp_enabled() && madvise((void *) start, size, MADV_HUGEPAGE) == 0) {
+        memory_huge = HUGE_TRANSPARENT;
+    }
+    return (void *) start;
+}
+
+
+/**
+ * @name    memory_setup
+ * @brief   Reserve the heap's address range and make the initial part accessible
+ * @retval  0 if ok, -1 if the memory could not be mapped
+ */
+int memory_setup(void) {
+    const char * env;
+    void * base;
+
+    if (memory_start != 0) {
+        return 0;
+    }
+
+    if ((env = getenv("MM_HEAP_SIZE")) != NULL && parse_size(env) != 0) {
+        heap_size = parse_size(env);
+    }
+    if ((env = getenv("MM_HEAP_MAX")) != NULL && parse_size(env) != 0) {
+        heap_max = parse_size(env);
+    }
+    if ((env = getenv("MM_HUGE_PAGES")) != NULL) {
+        huge_pages = strcmp(env, "0") != 0;
+    }
+    memory_page = huge_pages ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    heap_size = heap_round(heap_size);
+    heap_max = heap_round(heap_max);
+#ifdef MM_COMPACT
+    /* Offsets between the headers of the heap must fit in 32 bits */
+    if (heap_max > COMPACT_MAX) {
+        heap_max = COMPACT_MAX;
+    }
+    if (heap_size > COMPACT_MAX) {
+        heap_size = COMPACT_MAX;
+    }
+#endif
+    if (heap_max < heap_size) {
+        heap_max = heap_size;
+    }
+
+    if (huge_pages) {
+        base = reserve_huge(heap_max, heap_size);
+    } else {
+        base = mmap(NULL, heap_max, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    if (mprotect(base, heap_size, PROT_READ | PROT_WRITE) != 0) {
+        munmap(base, heap_max);
+        return -1;
+    }
+
+    memory_start = (uintptr_t) base;
+    memory_end   = (uintptr_t) base + heap_size;
+    memory_limit = (uintptr_t) base + heap_max;
+    return 0;
+}
+
+
+/**
+ * @name    memory_grow
+ * @brief   Make at least size more bytes accessible at memory_end
+ *
+ * The heap grows by whole segments of the initial heap size, or more if
+ * size requires it, in whole pages of memory_page bytes. With hugetlbfs
+ * pages the segment's pages are taken from the pool right away.
+ *
+ * @retval  The new memory_end, or 0 if the reserved range is used up
+ */
+uintptr_t memory_grow(size_t size) {
+    size_t grow = heap_round(size) > heap_size ? heap_round(size) : heap_size;
+    uintptr_t limit = memory_start + heap_max;
+
+    if (grow > limit - memory_end) {
+        grow = heap_round(size);
+        if (grow > limit - memory_end) {
+            return 0;
+        }
+    }
+    if (mprotect((void *) memory_end, grow, PROT_READ | PROT_WRITE) != 0) {
+        return 0;
+    }
+    if (memory_huge == HUGE_TLB && huge_populate(memory_end, grow) != 0) {
+        return 0;
+    }
+    memory_end += grow;
+    return memory_end;
+}
+
+
+/**
+ * @name    memory_map
+ * @brief   Map a separate zeroed range of at least size bytes
+ * @retval  Start of the range, or 0 if not possible. *mapped receives its size.
+ */
+uintptr_t memory_map(size_t size, size_t * mapped) {
+    void * p;
+
+    *mapped = page_round(size);
+    p = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? 0 : (uintptr_t) p;
+}
+
+
+/**
+ * @name    memory_remap
+ * @brief   Resize a range obtained with memory_map to at least size bytes, moving it if needed
+ * @retval  Start of the range, or 0 if not possible. *mapped receives its size.
+ */
+uintptr_t memory_remap(uintptr_t start, size_t old_size, size_t size, size_t * mapped) {
+    void * p;
+
+    *mapped = page_round(size);
+    p = mremap((void *) start, old_size, *mapped, MREMAP_MAYMOVE);
+    return p == MAP_FAILED ? 0 : (uintptr_t) p;
+}
+
+
+/**
+ * @name    memory_unmap
+ * @brief   Release a range obtained with memory_map
+ */
+void memory_unmap(uintptr_t start, size_t size) {
+    munmap((void *) start, size);
+}
+
 
-static int8_t skew[SKEW_SIZE];                        // Misalignment
-static int8_t memory[ALLOCATE_SIZE];
+/**
+ * @name    memory_release
+ * @brief   Give the pages of a page-aligned range back to the system, to be faulted in again zeroed
+ * @retval  Number of bytes of the range that were resident
+ *
+ * The range stays mapped, so its pages are simply faulted in again, zeroed,
+ * when they are next written or read.
+ */
+size_t memory_release(uintptr_t start, size_t size) {
+    unsigned char resident[256];
+    size_t released = 0;
+    size_t done, pages, i;
 
-const uintptr_t memory_start =  (uintptr_t) memory;
-const uintptr_t memory_end   =  (uintptr_t) memory + ALLOCATE_SIZE;
+    for (done = 0; done < size; done += pages * PAGE_SIZE) {
+        pages = (size - done) / PAGE_SIZE;
+        pages = pages < sizeof(resident) ? pages : sizeof(resident);
+        if (mincore((void *) (start + done), pages * PAGE_SIZE, resident) == 0) {
+            for (i = 0; i < pages; i++) {
+                released += (resident[i] & 1) * PAGE_SIZE;
+            }
+        }
+    }
+    if (madvise((void *) start, size, MADV_DONTNEED) != 0) {
+        return 0;
+    }
+    return released;
+}
@@ -6,178 +6,2196 @@
  * 
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "mm.h"
 
+#ifdef MM_TRACE
+/* The allocator functions are wrapped by traced ones, see mm_trace.c */
+#define simple_malloc        untraced_malloc
+#define simple_free          untraced_free
+#define simple_calloc        untraced_calloc
+#define simple_realloc       untraced_realloc
+#define simple_memalign      untraced_memalign
+#define simple_aligned_alloc untraced_aligned_alloc
+#define simple_malloc_batch  untraced_malloc_batch
+#define simple_free_batch    untraced_free_batch
+
+static void trace_thread_exit(void);
+#endif
 
 
 /* Proposed data structure elements */
 
+#ifndef MM_COMPACT
+
 typedef struct header {
-    struct header * next;     // Bit 0 is used to indicate free block
+    struct header * next;     // Bit 0 is used to indicate free block, bit 1 that the previous block is free, bit 2 a mapped block
     uint64_t user_block[0];   // Standard trick: Empty array to make sure start of user block is aligned
 } BlockHeader;
 
-/* Macros to handle the free flag at bit 0 of the next pointer of header pointed at by p */
-#define GET_NEXT(p)    (void *) ((uintptr_t) (p->next) & ~0x1)    /* Mask out free flag */
+/* Macros to handle the flags in the low bits of the next pointer of header pointed at by p */
+#define FLAG_MASK      (0x7)
+#define GET_NEXT(p)    (void *) ((uintptr_t) (p->next) & ~FLAG_MASK)    /* Mask out flags */
 #define GET_FREE(p)    (uint8_t) ( (uintptr_t) (p->next) & 0x1 )   /* OK -- do not change */
-#define SET_NEXT(p,n)  p->next = (void *) ((uintptr_t) n + GET_FREE(p))  /* Preserve free flag */
-#define SET_FREE(p,f)  p->next = f==0? GET_NEXT(p) : (void*) ((uintptr_t) p->next | 0x1)  /* Set free bit of p->next to f */
+#define SET_NEXT(p,n)  p->next = (void *) ((uintptr_t) n + ((uintptr_t) p->next & FLAG_MASK))  /* Preserve flags */
+#define SET_FREE(p,f)  p->next = f==0? (void*) ((uintptr_t) p->next & ~0x1) : (void*) ((uintptr_t) p->next | 0x1)  /* Set free bit of p->next to f */
+#define GET_PREV_FREE(p)   (uint8_t) ( ((uintptr_t) (p->next) >> 1) & 0x1 )
+#define SET_PREV_FREE(p,f) p->next = f==0? (void*) ((uintptr_t) p->next & ~0x2) : (void*) ((uintptr_t) p->next | 0x2)  /* Set prev free bit of p->next to f */
+#define GET_MAPPED(p)  (uint8_t) ( ((uintptr_t) (p->next) >> 2) & 0x1 )   /* Block has a mapping of its own */
+#define INIT_NEXT(p,n,f)   (p)->next = (void *) ((uintptr_t) (n) | (f))   /* Set next pointer and flags of a new header */
+
+#else
+
+/*
+ * Compact headers
+ *
+ * Built with MM_COMPACT (make HEADER=compact) a header is 32 bits: the offset
+ * of the next header from this one, which is a multiple of 8, with the flags
+ * in its low bits. Offsets are taken from the header rather than from the
+ * start of the heap, so mapped blocks outside the heap's range are encoded
+ * the same way. Headers start 4 bytes before a multiple of 8, so user blocks
+ * stay 8-byte aligned and block sizes are 4 more than a multiple of 8. The
+ * heap's range and very large blocks are limited to COMPACT_RANGE.
+ */
+typedef struct header {
+    int32_t next;             // Offset of the next header, bit 0 free block, bit 1 previous block free, bit 2 mapped block
+    uint32_t user_block[0];   // 8-byte aligned, as the header starts 4 bytes before a multiple of 8
+} BlockHeader;
+
+#define COMPACT_RANGE  (1UL << 31)   // Offsets are signed 32-bit numbers
+
+#define FLAG_MASK      (0x7)
+#define GET_NEXT(p)    (void *) ((uintptr_t) (p) + (intptr_t) ((p)->next & ~FLAG_MASK))    /* Add offset without flags */
+#define GET_FREE(p)    (uint8_t) ( (p)->next & 0x1 )
+#define SET_NEXT(p,n)  (p)->next = (int32_t) ((intptr_t) (n) - (intptr_t) (p)) | ((p)->next & FLAG_MASK)  /* Preserve flags */
+#define SET_FREE(p,f)  (p)->next = (f)==0? (p)->next & ~0x1 : (p)->next | 0x1
+#define GET_PREV_FREE(p)   (uint8_t) ( ((p)->next >> 1) & 0x1 )
+#define SET_PREV_FREE(p,f) (p)->next = (f)==0? (p)->next & ~0x2 : (p)->next | 0x2
+#define GET_MAPPED(p)  (uint8_t) ( ((p)->next >> 2) & 0x1 )
+#define INIT_NEXT(p,n,f)   (p)->next = (int32_t) ((intptr_t) (n) - (intptr_t) (p)) | (f)
+
+#endif
+
 #define SIZE(p)        (size_t) (((uintptr_t) GET_NEXT(p) - (uintptr_t) p) - sizeof(BlockHeader)) /* Calculate size of block from p and p->next */
 
-#define MIN_SIZE     (8)   // A block should have at least 8 bytes available for the user
+/*
+ * Boundary tags
+ *
+ * The last word of a free block (its footer) points back to the block's header,
+ * and the block following it has its prev free bit set. simple_free can then
+ * find a free predecessor in O(1) and merge with both neighbours immediately.
+ * Allocated blocks have no footer. With compact headers the footer is the
+ * 32-bit distance back to the header instead.
+ */
+#ifndef MM_COMPACT
+typedef BlockHeader * Footer;
+#define SET_FOOTER(p)  (((Footer *) GET_NEXT(p))[-1] = (p))       /* Write the footer of free block p */
+#define PREV_BLOCK(p)  (((Footer *) (p))[-1])                     /* Header of the free block before p */
+#define MIN_SIZE     (24)  // A block should have room for the free list links and footer when it is freed
+#else
+typedef uint32_t Footer;
+#define SET_FOOTER(p)  (((Footer *) GET_NEXT(p))[-1] = (uintptr_t) GET_NEXT(p) - (uintptr_t) (p))
+#define PREV_BLOCK(p)  ((BlockHeader *) ((uintptr_t) (p) - ((Footer *) (p))[-1]))
+#define MIN_SIZE     (20)
+#endif
+
+/*
+ * Segregated explicit free lists
+ *
+ * Free blocks are kept in size classes (bins). Bin k holds free blocks whose
+ * user size is in the range [2^k, 2^(k+1)). Each bin is a doubly linked list
+ * threaded through the (unused) user_block of its free blocks, so searching
+ * only visits free blocks and a block can be pushed or unlinked in O(1).
+ *
+ * Built with MM_TLSF (make ENGINE=tlsf) the bins are the finer classes of the
+ * two-level segregated fit engine in mm_tlsf.c instead, which finds a fitting
+ * block in constant time. Built with MM_BUDDY (make ENGINE=buddy) the heaps
+ * are managed as buddy systems by mm_buddy.c, which also takes over
+ * splitting and freeing blocks. Built with MM_BITMAP (make ENGINE=bitmap)
+ * the bins are replaced by bitmaps of free granules kept out of line, see
+ * mm_bitmap.c, and a search reads no block memory.
+ */
+typedef struct free_links {
+    BlockHeader * next;       // Next free block in the same bin
+    BlockHeader * prev;       // Previous free block in the same bin
+} FreeLinks;
+
+#if defined(MM_TLSF) || defined(MM_BITMAP)
+#define SL_LOG         (4)                  // Second-level classes per power of two, log2
+#define SL_COUNT       (1 << SL_LOG)
+#endif
+#ifdef MM_TLSF
+#define NUM_BINS       (64 * SL_COUNT)
+#else
+#define NUM_BINS       (64)
+#endif
+#ifdef MM_BITMAP
+#define MAP_DEPTH      (10)                 // Levels of a class's index, enough for any heap, see mm_bitmap.c
+#endif
+
+#ifndef MM_ALIGN
+#define MM_ALIGN       (8)                    // Alignment of every user_block, 8 or 16 (make ALIGN=16)
+#endif
+#ifndef MM_BUDDY
+#define BLOCK_GRAIN    (MM_ALIGN)             // All blocks start at a multiple of it from the first block
+#define BASE_ALIGN     (MM_ALIGN)             // Alignment of the first user_block of a heap
+#endif
+#define LINKS(p)       ((FreeLinks *) (p)->user_block)   /* Free list links of free block p */
+
+
+/*
+ * Runs
+ *
+ * Requests of up to RUN_MAX_SIZE bytes are served from runs: blocks of one
+ * page whose user_block starts on the page and is cut into objects of one
+ * size class, without headers. The classes are 8 bytes and the multiples of
+ * 16 bytes, so that every object larger than 8 bytes starts on a multiple
+ * of 16, as the page does. With MM_ALIGN 16 there is no 8-byte class.
+ * A run's size class and occupancy bitmap live in the descriptor of its
+ * page in run_table, which has one entry for every page of the reserved
+ * range, so the run of an object is found from its address alone. See mm_run.c.
+ */
+#define RUN_MAX_SIZE   (128)                         // Largest request served from runs
+#define RUN_CLASSES    (RUN_MAX_SIZE / 8)            // Indexed by size / 8 - 1, for 8 and each multiple of 16 bytes
+#define RUN_BYTES      (4096 - sizeof(BlockHeader))  // Bytes of a run's user_block holding objects
+#define RUN_WORDS      ((RUN_BYTES / 8 + 63) / 64)   // Bitmap words for the most objects in a run
+
+typedef struct run {
+    uint64_t used[RUN_WORDS];   // Bit i set while object i is allocated, and for bits past the last object
+    struct run * next;          // Runs of the same class with free objects, in their heap's runs list
+    struct run * prev;
+    struct heap * heap;         // Heap the run was carved from, NULL if the page holds no run
+    uint32_t size;              // Object size
+    uint16_t capacity;          // Number of objects
+    uint16_t count;             // Objects allocated
+} Run;
+
+static Run * run_table = NULL;  // Descriptors of the pages from memory_start to memory_limit
+
+
+/*
+ * Heaps
+ *
+ * A heap manages the blocks within one range of memory: the block list, the
+ * bins and the high-water mark, guarded by the heap's lock. The whole memory
+ * region is managed by the main heap. Each thread gets an arena of its own:
+ * a heap over one large block carved out of the main heap, so threads do not
+ * contend for a lock or share cache lines. Requests an arena cannot serve,
+ * and large ones, go to the main heap.
+ *
+ * The main heap grows on demand, see heap_grow. Very large blocks are not
+ * part of any heap but have a mapping of their own, marked by the mapped
+ * bit in their header.
+ *
+ * A block or run object freed by a thread that does not use its arena is
+ * pushed on the arena's remote_free stack without locking. The arena's thread reclaims
+ * the whole stack at once on its next allocation.
+ *
+ * Further heaps can be set up over buffers of the caller's with
+ * simple_heap_create, see Heap handles below.
+ */
+struct heap {
+    pthread_mutex_t lock;
+    BlockHeader * first;
+    BlockHeader * last;                  // End header
+    BlockHeader * bins[NUM_BINS];
+    Run * runs[RUN_CLASSES];             // Runs with free objects, per size class
+#ifdef MM_TLSF
+    uint64_t fl_bitmap;                  // Levels with a non-empty class
+    uint32_t sl_bitmap[64];              // Non-empty classes per level
+#elif defined(MM_BUDDY)
+    uint64_t bin_bitmap;                 // Non-empty bins
+#elif defined(MM_BITMAP)
+    uint64_t * free_start;               // Bit set on the first granule of each free block, see mm_bitmap.c
+    uint64_t * free_end;                 // Bit set on the last granule of each free block
+    uint64_t * free_index;               // Per size class, a tree of bits over the words of free_start
+    uint64_t * class_words;              // Per size class, words of free_start indexed for it
+    uint64_t fl_bitmap;                  // Levels with a non-empty class, as in mm_tlsf.c
+    uint32_t sl_bitmap[64];              // Non-empty classes per level
+    size_t map_words;                    // Words of free_start and of free_end
+    size_t index_level[MAP_DEPTH + 1];   // Offsets of the levels in a class's index, the last one its size
+    int index_levels;                    // Levels of a class's index
+    int map_classes;                     // Classes with an index
+#endif
+    size_t search_visits;                // Number of free blocks visited by searches
+    size_t search_hist[MALLOC_SEARCH_BUCKETS];  // Searches by number of free blocks visited, see search_bucket
+    size_t free_bytes;                   // Bytes in the bins, headers included
+    size_t free_blocks;                  // Number of blocks in the bins
+    uintptr_t high_water;                // See mark_written
+    uintptr_t start;                     // Range of memory managed by the heap
+    uintptr_t end;
+    _Atomic(void *) remote_free;         // User blocks freed by other threads, linked through their first word
+    atomic_int owned;                    // Arena is assigned to a thread
+    int borrowed;                        // Over a buffer of the caller's, which is never trimmed
+};
+
+#define MMAP_THRESHOLD (1024*1024)        // Requests from this size get a mapping of their own
+#define PAGE_SIZE      (4096)
+#define NUM_ARENAS     (8)
+#define ARENA_SIZE     (1024*1024)        // Memory carved from the main heap for an arena
+#define ARENA_LARGE    (ARENA_SIZE / 16)  // Larger requests go straight to the main heap
+
+static Heap main_heap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static Heap arenas[NUM_ARENAS];
+static atomic_int arena_count = 0;       // Arenas carved so far, published after initialization
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local Heap * thread_heap = NULL;
+
+
+/*
+ * Thread caches
+ *
+ * In front of the heaps each thread keeps a cache of small blocks it has
+ * freed, which serves most small requests without any shared state. Cached
+ * blocks and run objects still look allocated to their heap. The cache
+ * holds user blocks, so both kinds share a class. The second word of a
+ * cached block of more than 8 bytes holds its CACHE_KEY, so that freeing it
+ * again only has to search the cache when the key is there.
+ */
+#define CACHE_MAX_SIZE   (256)                    // Largest block size kept in the thread caches
+#define CACHE_CLASSES    (CACHE_MAX_SIZE / 8 + 1) // One class per multiple of 8 bytes
+#define CACHE_CLASS(s)   (((s) + 7) / 8)          // Class of blocks of s bytes, compact headers make them 4 more than a multiple of 8
+#define CACHE_LIMIT      (32)                     // Most blocks of one size kept by a thread
+#define CACHE_KEY(p)     ((void *) ((uintptr_t) (p) ^ (uintptr_t) &cache ^ 0x2545f4914f6cdd1dUL))  // Marks cached block p
+
+typedef struct thread_cache {
+    void * head[CACHE_CLASSES];         // Stacks of user blocks linked through their first word
+    uint32_t count[CACHE_CLASSES];
+    int registered;                     // Cleaned up by thread_exit
+    int exiting;                        // Set by thread_exit, the cache is no longer used
+    struct thread_cache * next;         // Registered caches, see simple_mallinfo
+    atomic_size_t mallocs;              // Calls counted by stats_call
+    atomic_size_t frees;
+    atomic_size_t failed;
+} ThreadCache;
 
+static _Thread_local ThreadCache cache;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
 
-static BlockHeader * first = NULL;
-static BlockHeader * current = NULL;
 
+/*
+ * High-water mark
+ *
+ * A heap's memory starts out zeroed above its high_water mark. Above the mark
+ * the allocator has not written anything, nor handed anything out to the
+ * user, except for the end header and the footer of a free block just before
+ * it. simple_calloc only has to clear memory below this mark.
+ */
 
 /**
- * @name    simple_init
- * @brief   Initialize the block structure within the available memory
+ * @name    mark_written
+ * @brief   Raise the high-water mark of h to cover memory up to (but not including) addr
+ */
+static inline void mark_written(Heap * h, void * addr) {
+    if ((uintptr_t) addr > h->high_water) {
+        h->high_water = (uintptr_t) addr;
+    }
+}
+
+
+/*
+ * Statistics
  *
+ * All counters are kept up to date as the allocator works, so simple_mallinfo
+ * only adds them up. The largest free block is the exception: it is looked
+ * up in the bins of each heap when asked for, see mm_aux.c. A heap counts the blocks in its bins and their bytes in
+ * bin_push and bin_remove, and the number of blocks each search visits, under
+ * its lock. Bytes in use are counted when blocks leave or return to a heap or
+ * a mapping, so blocks in thread caches count as in use. Calls are counted in
+ * the calling thread's cache, without any shared writes.
  */
-void simple_init() {
-    uintptr_t aligned_memory_start = (memory_start + 0x7) & ~0x7;
-    uintptr_t aligned_memory_end   = memory_end & ~0x7;
-    BlockHeader * last;
+static ThreadCache * caches = NULL;      // Registered thread caches
+static ThreadCache retired;              // Calls counted by threads that have exited
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t stats_in_use = 0;
+static atomic_size_t stats_peak = 0;
+static atomic_size_t stats_mapped = 0;   // Bytes in mappings of very large blocks
+static atomic_size_t stats_released = 0; // Resident bytes given back by trim_block
 
-    /* Already initalized ? */
-    if (first == NULL) {
-        /* Check that we have room for at least one free block and an end header */
-        if (aligned_memory_start + 2*sizeof(BlockHeader) + MIN_SIZE <= aligned_memory_end) {
-            // Placing the first block on first address of aligned memory
-            first = (BlockHeader *) aligned_memory_start;
 
-            // Placing the last (dummy) block (with user space 0 bytes) on the last 8 bytes of aligned memory space
-            last = (BlockHeader *) aligned_memory_end - sizeof(BlockHeader);
+/**
+ * @name    bin_count
+ * @brief   Count a block entering (n = 1) or leaving (n = -1) the bins of h
+ */
+static inline void bin_count(Heap * h, BlockHeader * block, int n) {
+    h->free_blocks += n;
+    h->free_bytes += n * (SIZE(block) + sizeof(BlockHeader));
+}
 
-            // Setting the free flag of the first (free) and last block (allocated)
-            SET_FREE(first,1);
-            SET_FREE(last,0);
 
-            /*
-             * Setting the next pointer of the first and last block.
-             * First blocks points to the last block, and the last block
-             * points to the first block, creating a circular linked list.
-             * First block will have user_block of size = (aligned memory - 2*sizeof(BlockHeader))
-             */
-            SET_NEXT(first, last);
-            SET_NEXT(last, first);
-        }
-        current = first;
+/**
+ * @name    search_bucket
+ * @brief   Histogram bucket of a search visiting visits free blocks: 0, 1, 2-3, 4-7, ...
+ */
+static inline int search_bucket(size_t visits) {
+    int bucket = visits == 0 ? 0 : 64 - __builtin_clzl(visits);
+    return bucket < MALLOC_SEARCH_BUCKETS ? bucket : MALLOC_SEARCH_BUCKETS - 1;
+}
+
+
+/**
+ * @name    stats_use
+ * @brief   Add bytes (which may be negative) to the bytes in use, raising the peak
+ */
+static inline void stats_use(ptrdiff_t bytes) {
+    size_t in_use = atomic_fetch_add_explicit(&stats_in_use, bytes, memory_order_relaxed) + bytes;
+    size_t peak = atomic_load_explicit(&stats_peak, memory_order_relaxed);
+
+    while (in_use > peak && !atomic_compare_exchange_weak_explicit(&stats_peak, &peak, in_use,
+                                                                   memory_order_relaxed,
+                                                                   memory_order_relaxed)) {
     }
 }
 
 
 /**
- * @name    simple_malloc
- * @brief   Allocate at least size contiguous bytes of memory and return a pointer to the first byte.
+ * @name    stats_call
+ * @brief   Count a call in one of the calling thread's counters
  *
- * This function should behave similar to a normal malloc implementation.
+ * Only the owning thread writes the counter, so no atomic increment is needed.
+ */
+static inline void stats_call(atomic_size_t * counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+
+/*
+ * Trimming
  *
- * @param size_t size Number of bytes to allocate.
- * @retval Pointer to the start of the allocated memory or NULL if not possible.
+ * Freeing memory leaves its pages resident. When a free block of at least
+ * TRIM_THRESHOLD bytes comes about, the pages inside it are given back to
+ * the system with memory_release, except for its first TRIM_PAD bytes, from
+ * which the next allocations are cut. simple_trim gives back the pages of
+ * all free blocks. The header, the free list links and the footer stay in
+ * place, so the block is managed as before, and its pages fault back in,
+ * zeroed, when it is used again. Pages above the heap's high-water mark were
+ * never touched and are left alone. Pages are given back whole in the size
+ * backing the heap, so trimming does not split huge pages. A heap on
+ * hugetlbfs pages is not trimmed at all: its range is reserved with
+ * MAP_NORESERVE, so a page given back returns to the system's pool, and
+ * faulting it in again raises SIGBUS once the pool has run dry.
+ */
+#define TRIM_THRESHOLD (4*1024*1024)    // Free blocks from this size have their pages given back, well below a heap segment
+#define TRIM_PAD       (1024*1024)      // Bytes at the start of a free block kept resident
+
+
+/**
+ * @name    trim_block
+ * @brief   Give back the pages of free block block that lie within [lo, hi)
+ * @retval  Number of resident bytes given back
  *
+ * The caller's buffer under a heap handle is left as it is, and so are
+ * hugetlbfs pages, see Trimming.
+ * Must be called with h->lock held.
  */
-void* simple_malloc(size_t size) {
-    if (first == NULL) {
-        simple_init();
-        if (first == NULL) return NULL;
+static size_t trim_block(Heap * h, BlockHeader * block, uintptr_t lo, uintptr_t hi) {
+    uintptr_t start = (uintptr_t) (LINKS(block) + 1);
+    uintptr_t end = (uintptr_t) GET_NEXT(block) - sizeof(Footer);
+    size_t released;
+
+    if (h->borrowed || memory_huge == HUGE_TLB) {
+        return 0;
+    }
+    start = ((lo > start ? lo : start) + memory_page - 1) & ~(memory_page - 1);
+    end = hi < end ? hi : end;
+    end = (end < h->high_water ? end : h->high_water) & ~(memory_page - 1);
+    if (start >= end) {
+        return 0;
+    }
+    released = memory_release(start, end - start);
+    atomic_fetch_add_explicit(&stats_released, released, memory_order_relaxed);
+    return released;
+}
+
+
+#if defined(MM_TLSF)
+#include "mm_tlsf.c"
+#elif defined(MM_BUDDY)
+#include "mm_buddy.c"
+#elif defined(MM_BITMAP)
+#include "mm_bitmap.c"
+#else
+
+/**
+ * @name    bin_index
+ * @brief   Find the size class of a block with size bytes available for the user
+ */
+static inline int bin_index(size_t size) {
+    return 63 - __builtin_clzl(size);
+}
+
+
+/**
+ * @name    bin_push
+ * @brief   Insert a free block at the head of the bin matching its size
+ */
+static inline void bin_push(Heap * h, BlockHeader * block) {
+    int i = bin_index(SIZE(block));
+    LINKS(block)->next = h->bins[i];
+    LINKS(block)->prev = NULL;
+    if (h->bins[i] != NULL) {
+        LINKS(h->bins[i])->prev = block;
+    }
+    h->bins[i] = block;
+    mark_written(h, LINKS(block) + 1);
+    bin_count(h, block, 1);
+}
+
+
+/**
+ * @name    bin_remove
+ * @brief   Unlink a free block from the bin matching its size
+ */
+static inline void bin_remove(Heap * h, BlockHeader * block) {
+    BlockHeader * next = LINKS(block)->next;
+    BlockHeader * prev = LINKS(block)->prev;
+    bin_count(h, block, -1);
+    if (prev != NULL) {
+        LINKS(prev)->next = next;
+    } else {
+        h->bins[bin_index(SIZE(block))] = next;
+    }
+    if (next != NULL) {
+        LINKS(next)->prev = prev;
+    }
+}
+
+
+/**
+ * @name    bin_fit_size
+ * @brief   Size to make room for when bin_search is to find a block of size bytes
+ */
+static inline size_t bin_fit_size(size_t size) {
+    return size;
+}
+
+
+/**
+ * @name    bin_search
+ * @brief   Find and unlink a free block with at least size bytes available
+ * @retval  The block or NULL if no bin holds a large enough block
+ */
+static BlockHeader * bin_search(Heap * h, size_t size) {
+    int i = bin_index(size);
+    BlockHeader * block;
+
+    /* Blocks in the matching bin may be too small, so search it first-fit */
+    for (block = h->bins[i]; block != NULL; block = LINKS(block)->next) {
+        h->search_visits++;
+        if (SIZE(block) >= size) {
+            bin_remove(h, block);
+            return block;
+        }
+    }
+
+    /* Any block in a larger bin will do */
+    for (i++; i < NUM_BINS; i++) {
+        if (h->bins[i] != NULL) {
+            block = h->bins[i];
+            h->search_visits++;
+            bin_remove(h, block);
+            return block;
+        }
+    }
+    return NULL;
+}
+
+#endif
+
+
+/**
+ * @name    too_large
+ * @brief   Is a request of size bytes more than any heap or mapping can hold?
+ *
+ * Headers, rounding and alignment slack are added to request sizes, so the
+ * calls refuse sizes (and alignments) from MAX_REQUEST up, where these
+ * additions could wrap around, with ENOMEM.
+ */
+#define MAX_REQUEST    (SIZE_MAX / 4)
+
+static inline int too_large(size_t size) {
+    if (size < MAX_REQUEST) {
+        return 0;
     }
+    errno = ENOMEM;
+    return 1;
+}
+
 
-    /* Size alignment */
+/**
+ * @name    align_size
+ * @brief   Round a requested size up to at least MIN_SIZE, so that header and user_block take a multiple of MM_ALIGN bytes
+ *
+ * size must be below MAX_REQUEST, see too_large.
+ */
+static inline size_t align_size(size_t size) {
     size_t aligned_size;
-    if(size % 8 != 0) {
-        aligned_size = size + (8 - (size % 8));
+    size_t total;
+    if (size < MIN_SIZE) {
+        size = MIN_SIZE;
+    }
+    total = size + sizeof(BlockHeader);
+    if(total % MM_ALIGN != 0) {
+        aligned_size = size + (MM_ALIGN - (total % MM_ALIGN));
     } else {
         aligned_size = size;
     }
-    /* Search for a free block */
-    BlockHeader * search_start = current;
-    do {
-        if (GET_FREE(current)) {
-            /* Coalescing consecutive free blocks */
-            BlockHeader * next = GET_NEXT(current);
-            while(GET_FREE(next)){
-                // Coalesce
-                SET_NEXT(current, GET_NEXT(next));
-                next = GET_NEXT(next);
-            }
-            /* Check if free block is large enough */
-            if (SIZE(current) >= aligned_size) {
-                /* Will the remainder be large enough for a new block? */
-                if (SIZE(current) - aligned_size < sizeof(BlockHeader) + MIN_SIZE) {
-                    /* Use block as is, marking it non-free*/
-                    SET_FREE(current, 0);
-                } else {
-                    // Create new block at the end of the allocated user_block
-                    BlockHeader * new_block = (BlockHeader *) ((uintptr_t) current->user_block + aligned_size);
-
-                    // Insert new block into the linked list
-                    new_block->next = current->next;
-                    current->next = new_block;
-
-                    /*
-                     * Using following lines should result in the same as 2 lines above, but results
-                     * in a segmentation fault when running 'malloc_check'
-                     *
-                     * SET_NEXT(new_block, GET_NEXT(current));
-                     * SET_NEXT(current, new_block);
-                     */
-
-                    // Set the free flag of current block to 0
-                    SET_FREE(current, 0);
-                }
-
-                /* Return address of current's user_block and advance current */
-                void * user_block = (void *) current->user_block;
-                current = GET_NEXT(current);
-                return (void *) user_block;
-            }
+    return aligned_size;
+}
+
+
+#ifndef MM_BUDDY
+
+/**
+ * @name    split_block
+ * @brief   Shrink an allocated block to size bytes, returning the tail to the bins
+ *
+ * Nothing happens if the tail would be too small to form a block of its own.
+ * The tail is merged with the following block if that one is free.
+ */
+static void split_block(Heap * h, BlockHeader * block, size_t size) {
+    /* Will the remainder be large enough for a new block? */
+    if (SIZE(block) - size < sizeof(BlockHeader) + MIN_SIZE) {
+        return;
+    }
+
+    // Create new (free) block at the end of the allocated user_block
+    BlockHeader * new_block = (BlockHeader *) ((uintptr_t) block->user_block + size);
+    BlockHeader * next = GET_NEXT(block);
+
+    // Insert new block into the linked list. Its predecessor is allocated
+    INIT_NEXT(new_block, next, 0x1);
+    SET_NEXT(block, new_block);
+
+    // Coalesce with the following block
+    if (GET_FREE(next)) {
+        bin_remove(h, next);
+        SET_NEXT(new_block, GET_NEXT(next));
+    }
+
+    // Return the remainder to the bins
+    SET_FOOTER(new_block);
+    next = GET_NEXT(new_block);
+    SET_PREV_FREE(next, 1);
+    bin_push(h, new_block);
+}
+
+#endif
+
+
+static void free_block(Heap * h, BlockHeader * block);
+
+
+/**
+ * @name    heap_init
+ * @brief   Initialize the block structure of a heap within [start, end)
+ *
+ * Memory from clean onwards must be zero, see mark_written.
+ */
+static void heap_init(Heap * h, uintptr_t start, uintptr_t end, uintptr_t clean) {
+    uintptr_t aligned_memory_start = ((start + sizeof(BlockHeader) + BASE_ALIGN - 1) & ~(BASE_ALIGN - 1))
+                                     - sizeof(BlockHeader);
+    BlockHeader * first;
+    BlockHeader * last;
+
+    h->start = start;
+    h->end = end;
+    h->high_water = clean;
+
+    /* Check that we have room for at least one free block and an end header */
+    if (aligned_memory_start + 2*sizeof(BlockHeader) + MIN_SIZE <= end) {
+        // Placing the first block on first address of aligned memory
+        first = (BlockHeader *) aligned_memory_start;
+
+        // Placing the last (dummy) block (with user space 0 bytes) on the last grain of memory space
+        last = (BlockHeader *) (aligned_memory_start
+                                + ((end - sizeof(BlockHeader) - aligned_memory_start) & ~(BLOCK_GRAIN - 1)));
+
+        /*
+         * Setting the next pointer of the first and last block.
+         * First blocks points to the last block, and the last block
+         * points to the first block, creating a circular linked list.
+         * First block will have user_block of size = (aligned memory - 2*sizeof(BlockHeader))
+         * Both blocks start out allocated, the first one is freed below
+         */
+        INIT_NEXT(first, last, 0);
+        INIT_NEXT(last, first, 0);
+
+        h->first = first;
+        h->last = last;
+#ifdef MM_BITMAP
+        /* The main heap may grow up to memory_limit */
+        if (!bitmap_init(h, h == &main_heap ? memory_limit : end)) {
+            h->first = NULL;
+            return;
         }
+#endif
+        mark_written(h, first->user_block);
+        free_block(h, first);
+    }
+}
 
-        current = GET_NEXT(current);
-    } while (current != search_start);
 
-    /* None found */
-    return NULL;
+/**
+ * @name    simple_init
+ * @brief   Initialize the main heap within the available memory, and the run descriptors
+ *
+ * Must be called with the main heap's lock held.
+ */
+static void simple_init() {
+    size_t mapped;
+
+    /* Already initalized ? */
+    if (main_heap.first == NULL && memory_setup() == 0) {
+        /* Without descriptors, small requests get blocks like any other */
+        run_table = (Run *) memory_map((memory_limit - memory_start) / PAGE_SIZE * sizeof(Run), &mapped);
+
+        /* The memory region is freshly mapped, so zero-initialised */
+        heap_init(&main_heap, memory_start, memory_end, memory_start);
+    }
 }
 
 
 /**
- * @name    simple_free
- * @brief   Frees previously allocated memory and makes it available for subsequent calls to simple_malloc
+ * @name    heap_grow
+ * @brief   Extend the main heap by a segment with room for a block of size bytes
  *
- * This function should behave similar to a normal free implementation.
+ * The new memory directly follows the heap, so the old end header becomes
+ * the header of a block spanning the new segment, with a new end header
+ * after it. Freeing that block merges it with a free block before it.
+ * Must be called with the main heap's lock held.
  *
- * @param void *ptr Pointer to the memory to free.
+ * @retval  1 if the heap grew, 0 if not possible
+ */
+static int heap_grow(Heap * h, size_t size) {
+    BlockHeader * old_last = h->last;
+    BlockHeader * last;
+    uintptr_t end = memory_grow(size + 16*sizeof(BlockHeader));
+
+    if (end == 0) {
+        return 0;
+    }
+
+    // Placing the new last (dummy) block as heap_init does
+    last = (BlockHeader *) ((uintptr_t) h->first
+                            + ((end - sizeof(BlockHeader) - (uintptr_t) h->first) & ~(BLOCK_GRAIN - 1)));
+    INIT_NEXT(last, h->first, 0);
+
+    // The old last block now spans the new memory, and is released as an allocated block
+    SET_NEXT(old_last, last);
+    mark_written(h, old_last->user_block);
+    h->end = end;
+    h->last = last;
+    free_block(h, old_last);
+    return 1;
+}
+
+
+/**
+ * @name    align_block
+ * @brief   Move the start of an allocated block up to the first suitably aligned user_block
+ *
+ * The leading gap becomes a free block of its own, so it must be large
+ * enough for one, and is widened by whole steps of alignment until it is.
+ * It then stays below alignment + sizeof(BlockHeader) + MIN_SIZE bytes,
+ * which is how much more room than the caller needs the block must have.
+ * Must be called with h->lock held.
  *
+ * @retval  The block starting at the aligned user_block
  */
-void simple_free(void * ptr) {
-    /*
-     * A guard could be implemented here to check if ptr is within the memory space
-     */
+static BlockHeader * align_block(Heap * h, BlockHeader * block, size_t alignment) {
+    uintptr_t user_block = (uintptr_t) block->user_block;
+    uintptr_t aligned = (user_block + alignment - 1) & ~(alignment - 1);
 
-    BlockHeader * block = ptr - 8; /* Find block corresponding to ptr */
-    if (GET_FREE(block)) {
-        /* Block is not in use -- probably an error */
-        return;
+    if (aligned == user_block) {
+        return block;
+    }
+    while (aligned - user_block < sizeof(BlockHeader) + MIN_SIZE) {
+        aligned += alignment;
+    }
+
+    // Create the aligned block and give the gap back
+    BlockHeader * aligned_block = (BlockHeader *) (aligned - sizeof(BlockHeader));
+    INIT_NEXT(aligned_block, GET_NEXT(block), 0);
+    SET_NEXT(block, aligned_block);
+    free_block(h, block);
+    return aligned_block;
+}
+
+
+/**
+ * @name    alloc_block
+ * @brief   Find a free block in h with room for size bytes and mark it allocated
+ *
+ * With an alignment above MM_ALIGN the user_block is placed on a multiple of it.
+ * Unless it is NULL, clean receives the high-water mark of h once the block
+ * is found, before splitting off its tail raises the mark past it.
+ *
+ * @retval  The block or NULL if not possible
+ *
+ * Must be called with h->lock held.
+ */
+static BlockHeader * alloc_block(Heap * h, size_t size, size_t alignment, uintptr_t * clean) {
+    if (h->first == NULL) {
+        /* Only the main heap is initialized on first use */
+        simple_init();
+        if (h->first == NULL) return NULL;
+    }
+
+    /* Size alignment, with room to move an aligned block into place */
+    size_t aligned_size = align_size(size);
+    size_t search_size = aligned_size;
+#ifdef MM_BUDDY
+    /* Blocks of up to a page are aligned to their size already */
+    if (alignment > MM_ALIGN && alignment <= BASE_ALIGN) {
+        aligned_size = search_size = aligned_size > alignment - sizeof(BlockHeader) ? aligned_size
+                                                                          : alignment - sizeof(BlockHeader);
+        alignment = MM_ALIGN;
     }
+#endif
+    if (alignment > MM_ALIGN) {
+        search_size += alignment + sizeof(BlockHeader) + MIN_SIZE;
+    }
+
+    /* Search the bins for a free block, growing the main heap if none fits */
+    size_t visits = h->search_visits;
+    BlockHeader * block = bin_search(h, search_size);
+    if (block == NULL && h == &main_heap && heap_grow(h, bin_fit_size(search_size))) {
+        block = bin_search(h, search_size);
+    }
+    h->search_hist[search_bucket(h->search_visits - visits)]++;
+    if (block == NULL) {
+        /* None found */
+        return NULL;
+    }
+    if (clean != NULL) {
+        *clean = h->high_water;
+    }
+
+    /* Mark block non-free, so the following block loses its free predecessor */
+    BlockHeader * next = GET_NEXT(block);
+    SET_FREE(block, 0);
+    SET_PREV_FREE(next, 0);
+
+    if (alignment > MM_ALIGN) {
+        block = align_block(h, block, alignment);
+    }
+
+    /* Return the unused tail to the bins */
+    split_block(h, block, aligned_size);
+    return block;
+}
+
+
+#ifndef MM_BUDDY
+
+/**
+ * @name    free_block
+ * @brief   Mark an allocated block free, coalesce it with its neighbours and bin it
+ *
+ * Must be called with h->lock held.
+ */
+static void free_block(Heap * h, BlockHeader * block) {
+    /* The range to trim: the block and any neighbours too small to have been trimmed */
+    uintptr_t lo = (uintptr_t) block;
+    uintptr_t hi = (uintptr_t) GET_NEXT(block);
+
     /* Free block */
     SET_FREE(block, 1);
-    /* Possibly coalesce consecutive free blocks here */
-    if(GET_FREE(block->next)){
-        // Coalesce
-        BlockHeader * next = GET_NEXT(block);
+
+    /* Coalesce with the following block */
+    BlockHeader * next = GET_NEXT(block);
+    if (GET_FREE(next)) {
+        if (SIZE(next) < TRIM_THRESHOLD) {
+            hi = (uintptr_t) GET_NEXT(next);
+        }
+        bin_remove(h, next);
         SET_NEXT(block, GET_NEXT(next));
     }
 
-    // Set original pointer value to NULL
-    ptr = NULL;
+    /* Coalesce with the preceding block, found through its footer */
+    if (GET_PREV_FREE(block)) {
+        BlockHeader * prev = PREV_BLOCK(block);
+        if (SIZE(prev) < TRIM_THRESHOLD) {
+            lo = (uintptr_t) prev;
+        }
+        bin_remove(h, prev);
+        SET_NEXT(prev, GET_NEXT(block));
+        block = prev;
+    }
+
+    /* Write the footer and tell the following block that its predecessor is free */
+    SET_FOOTER(block);
+    next = GET_NEXT(block);
+    SET_PREV_FREE(next, 1);
+    bin_push(h, block);
+    if (SIZE(block) >= TRIM_THRESHOLD) {
+        trim_block(h, block, lo > (uintptr_t) block + TRIM_PAD ? lo : (uintptr_t) block + TRIM_PAD, hi);
+    }
 }
 
-#include "mm_aux.c"
+#endif
+
+
+#include "mm_run.c"
+
+
+/**
+ * @name    heap_free
+ * @brief   Give an allocated block or run object back to h, given its user block
+ *
+ * Must be called with h->lock held.
+ */
+static void heap_free(Heap * h, void * ptr) {
+    Run * run = run_of(ptr);
 
+    if (run != NULL) {
+        run_free(h, run, ptr);
+    } else {
+        free_block(h, (BlockHeader *) ptr - 1);
+    }
+}
+
+
+/**
+ * @name    remote_push
+ * @brief   Hand an allocated block or run object back to a heap used by another thread, without locking
+ */
+static void remote_push(Heap * h, void * ptr) {
+    void * head = atomic_load_explicit(&h->remote_free, memory_order_relaxed);
+    do {
+        *(void **) ptr = head;
+    } while (!atomic_compare_exchange_weak_explicit(&h->remote_free, &head, ptr,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+
+/**
+ * @name    remote_drain
+ * @brief   Free all blocks and run objects other threads have pushed on h
+ *
+ * Must be called with h->lock held. Taking the whole stack at once means a
+ * block cannot be popped while another thread pushes it again.
+ */
+static void remote_drain(Heap * h) {
+    void * ptr;
 
+    if (atomic_load_explicit(&h->remote_free, memory_order_relaxed) == NULL) {
+        return;
+    }
+    ptr = atomic_exchange_explicit(&h->remote_free, NULL, memory_order_acquire);
+    while (ptr != NULL) {
+        void * next = *(void **) ptr;
+        heap_free(h, ptr);
+        ptr = next;
+    }
+}
+
+
+/**
+ * @name    heap_of
+ * @brief   Find the heap a block was allocated from
+ */
+static Heap * heap_of(BlockHeader * block) {
+    int n = atomic_load_explicit(&arena_count, memory_order_acquire);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if ((uintptr_t) block >= arenas[i].start && (uintptr_t) block < arenas[i].end) {
+            return &arenas[i];
+        }
+    }
+    return &main_heap;
+}
+
+
+/**
+ * @name    heap_alloc
+ * @brief   Allocate a block of size bytes from h, see alloc_block
+ *
+ * clean receives the high-water mark of h from before the block was split.
+ */
+static BlockHeader * heap_alloc(Heap * h, size_t size, size_t alignment, uintptr_t * clean) {
+    BlockHeader * block;
+
+    pthread_mutex_lock(&h->lock);
+    remote_drain(h);
+    block = alloc_block(h, size, alignment, clean);
+    if (block != NULL) {
+        /* The user may write anywhere in the block */
+        mark_written(h, GET_NEXT(block));
+    }
+    pthread_mutex_unlock(&h->lock);
+    return block;
+}
+
+
+/**
+ * @name    heap_alloc_batch
+ * @brief   Allocate up to n blocks of size bytes from h, taking its lock once
+ *
+ * Each free block found is cut into consecutive blocks of the same size in
+ * one pass, and only the last of them has its tail split off. When no free
+ * block has room for all of them, half as many are carved at a time. At
+ * most MMAP_THRESHOLD bytes are carved from one free block.
+ *
+ * @retval  Number of blocks allocated, their user_blocks are stored in out
+ */
+static size_t heap_alloc_batch(Heap * h, size_t size, size_t n, void ** out) {
+    size_t aligned_size = align_size(size);
+#ifdef MM_BUDDY
+    size_t stride = buddy_size(aligned_size);   /* Pieces of a buddy are buddies too */
+#else
+    size_t stride = sizeof(BlockHeader) + aligned_size;
+#endif
+    size_t limit = MMAP_THRESHOLD / stride > 0 ? MMAP_THRESHOLD / stride : 1;
+    size_t bytes = 0;
+    size_t done = 0;
+    size_t count = n < limit ? n : limit;
+    size_t i;
+
+    pthread_mutex_lock(&h->lock);
+    remote_drain(h);
+    while (done < n) {
+        BlockHeader * block;
+        BlockHeader * last;
+
+        if (count > n - done) {
+            count = n - done;
+        }
+        block = alloc_block(h, count * stride - sizeof(BlockHeader), 0, NULL);
+        if (block == NULL) {
+            if (count == 1) {
+                break;
+            }
+            count = (count + 1) / 2;
+            continue;
+        }
+
+        /* Cut the block into allocated blocks, the last one keeping the rest */
+        last = block;
+        for (i = 1; i < count; i++) {
+            BlockHeader * piece = (BlockHeader *) ((uintptr_t) block + i * stride);
+            INIT_NEXT(piece, GET_NEXT(last), 0);
+            SET_NEXT(last, piece);
+            out[done++] = (void *) last->user_block;
+            bytes += SIZE(last);
+            last = piece;
+        }
+        split_block(h, last, aligned_size);
+        out[done++] = (void *) last->user_block;
+        bytes += SIZE(last);
+        mark_written(h, GET_NEXT(last));
+    }
+    pthread_mutex_unlock(&h->lock);
+
+    stats_use(bytes);
+    return done;
+}
+
+
+/**
+ * @name    heap_objects
+ * @brief   Allocate up to n run objects of size bytes from h, see run_alloc
+ * @retval  Number of objects allocated, stored in out
+ */
+static size_t heap_objects(Heap * h, size_t size, size_t n, void ** out) {
+    size_t done;
+
+    pthread_mutex_lock(&h->lock);
+    remote_drain(h);
+    done = run_alloc(h, size, n, out);
+    pthread_mutex_unlock(&h->lock);
+    return done;
+}
+
+
+/**
+ * @name    heap_release
+ * @brief   Give an allocated block or run object back to its heap, given its user block
+ *
+ * It is freed directly if it belongs to the main heap or to the calling
+ * thread's arena, and pushed on its arena's remote stack otherwise.
+ */
+static void heap_release(void * ptr) {
+    Run * run = run_of(ptr);
+    BlockHeader * block = (BlockHeader *) ptr - 1;
+    Heap * h;
+
+    if (run != NULL) {
+        h = run->heap;
+        stats_use(-(ptrdiff_t) run->size);
+    } else {
+        h = heap_of(block);
+        stats_use(-(ptrdiff_t) SIZE(block));
+    }
+    if (h == &main_heap || h == thread_heap) {
+        pthread_mutex_lock(&h->lock);
+        heap_free(h, ptr);
+        pthread_mutex_unlock(&h->lock);
+    } else {
+        remote_push(h, ptr);
+    }
+}
+
+
+/**
+ * @name    cache_flush
+ * @brief   Give all blocks of one class in a thread cache back to their heaps
+ */
+static void cache_flush(ThreadCache * tc, int class) {
+    while (tc->head[class] != NULL) {
+        void * ptr = tc->head[class];
+        tc->head[class] = *(void **) ptr;
+        heap_release(ptr);
+    }
+    tc->count[class] = 0;
+}
+
+
+/**
+ * @name    thread_exit
+ * @brief   Flush the cache of an exiting thread and give up its arena
+ *
+ * Destructors of other keys may still allocate and free afterwards. The
+ * thread then stays registered, uses the main heap and bypasses its cache,
+ * so it claims no arena and keeps no blocks that nothing would give back.
+ */
+static void thread_exit(void * arg) {
+    ThreadCache * tc = arg;
+    Heap * h = thread_heap;
+    ThreadCache ** p;
+    int class;
+
+    tc->exiting = 1;
+    for (class = 0; class < CACHE_CLASSES; class++) {
+        cache_flush(tc, class);
+    }
+
+    /* Keep the counts of the thread after it has gone */
+    pthread_mutex_lock(&stats_lock);
+    for (p = &caches; *p != tc; p = &(*p)->next) {
+    }
+    *p = tc->next;
+    retired.mallocs += tc->mallocs;
+    retired.frees += tc->frees;
+    retired.failed += tc->failed;
+    pthread_mutex_unlock(&stats_lock);
+
+#ifdef MM_TRACE
+    trace_thread_exit();
+#endif
+
+    if (h != NULL && h != &main_heap) {
+        pthread_mutex_lock(&h->lock);
+        remote_drain(h);
+        pthread_mutex_unlock(&h->lock);
+        atomic_store(&h->owned, 0);
+    }
+    thread_heap = &main_heap;
+}
+
+
+static void thread_key_create(void) {
+    pthread_key_create(&thread_key, thread_exit);
+}
+
+
+/**
+ * @name    thread_register
+ * @brief   Make sure thread_exit runs when the calling thread exits
+ *
+ * The thread counts as registered before pthread_setspecific, which may
+ * itself allocate, and so come back here.
+ */
+static inline void thread_register(void) {
+    if (!cache.registered) {
+        cache.registered = 1;
+        pthread_once(&thread_key_once, thread_key_create);
+        pthread_setspecific(thread_key, &cache);
+
+        pthread_mutex_lock(&stats_lock);
+        cache.next = caches;
+        caches = &cache;
+        pthread_mutex_unlock(&stats_lock);
+    }
+}
+
+
+/**
+ * @name    thread_heap_get
+ * @brief   Find the arena of the calling thread, assigning one on first use
+ *
+ * A thread reuses the arena of a thread that has exited if there is one,
+ * otherwise a new arena is carved from the main heap. When all arenas are
+ * taken, or the main heap is too full, the thread uses the main heap.
+ */
+static Heap * thread_heap_get(void) {
+    int n, i;
+
+    if (thread_heap != NULL) {
+        return thread_heap;
+    }
+    thread_register();
+
+    pthread_mutex_lock(&arena_lock);
+    n = atomic_load_explicit(&arena_count, memory_order_relaxed);
+    for (i = 0; i < n; i++) {
+        if (atomic_load(&arenas[i].owned) == 0) {
+            atomic_store(&arenas[i].owned, 1);
+            thread_heap = &arenas[i];
+            break;
+        }
+    }
+    if (thread_heap == NULL && n < NUM_ARENAS) {
+        uintptr_t clean;
+        BlockHeader * block = heap_alloc(&main_heap, ARENA_SIZE - sizeof(BlockHeader), 0, &clean);
+        if (block != NULL) {
+            Heap * h = &arenas[n];
+            uintptr_t start = (uintptr_t) block->user_block;
+            uintptr_t end   = (uintptr_t) GET_NEXT(block);
+
+            /* Zero the footer that may sit just before the end header, as simple_calloc does */
+            ((Footer *) end)[-1] = 0;
+            pthread_mutex_init(&h->lock, NULL);
+            heap_init(h, start, end, clean < start ? start : clean > end ? end : clean);
+            atomic_store(&h->owned, 1);
+            atomic_store_explicit(&arena_count, n + 1, memory_order_release);
+            thread_heap = h;
+        }
+    }
+    if (thread_heap == NULL) {
+        thread_heap = &main_heap;
+    }
+    pthread_mutex_unlock(&arena_lock);
+
+    return thread_heap;
+}
+
+
+/**
+ * @name    mapping_start
+ * @brief   Start of the mapping of a mapped block, the page its header is on
+ */
+static inline uintptr_t mapping_start(BlockHeader * block) {
+    return (uintptr_t) block & ~(PAGE_SIZE - 1);
+}
+
+
+/*
+ * Mapping registry
+ *
+ * The headers of all blocks with a mapping of their own are kept in a hash
+ * set, so simple_owns can tell them from memory of other allocators without
+ * reading it. The set is an open addressing table in a mapping of its own,
+ * with removed entries marked by MAPPING_GONE.
+ */
+#define MAPPINGS       (1 << 16)   // Slots in the registry, at most 3/4 used
+#define MAPPING_GONE   (1)
+
+static uintptr_t * mappings = NULL;
+static size_t mappings_used = 0;      // Slots holding a block or MAPPING_GONE
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * @name    mapping_slot
+ * @brief   First slot to probe for a block
+ */
+static inline size_t mapping_slot(uintptr_t block) {
+    return (block / PAGE_SIZE * 0x9E3779B97F4A7C15UL) >> 48;
+}
+
+
+/**
+ * @name    mapping_find
+ * @brief   Is block the header of a registered mapped block?
+ *
+ * Must be called with mappings_lock held.
+ */
+static int mapping_find(uintptr_t block) {
+    size_t i;
+
+    if (mappings == NULL) {
+        return 0;
+    }
+    for (i = mapping_slot(block); mappings[i] != 0; i = (i + 1) % MAPPINGS) {
+        if (mappings[i] == block) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @name    mapping_add
+ * @brief   Register a newly mapped block
+ * @retval  1 if ok, 0 if the registry is full
+ */
+static int mapping_add(uintptr_t block) {
+    size_t mapped;
+    size_t i;
+    int ok = 0;
+
+    pthread_mutex_lock(&mappings_lock);
+    if (mappings == NULL) {
+        /* A new mapping is all zero */
+        mappings = (uintptr_t *) memory_map(MAPPINGS * sizeof(uintptr_t), &mapped);
+    }
+    if (mappings != NULL && mappings_used < MAPPINGS / 4 * 3) {
+        for (i = mapping_slot(block); mappings[i] > MAPPING_GONE; i = (i + 1) % MAPPINGS) {
+        }
+        mappings_used += mappings[i] == 0;
+        mappings[i] = block;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&mappings_lock);
+    return ok;
+}
+
+
+/**
+ * @name    mapping_remove
+ * @brief   Unregister a mapped block
+ */
+static void mapping_remove(uintptr_t block) {
+    size_t i;
+
+    pthread_mutex_lock(&mappings_lock);
+    for (i = mapping_slot(block); mappings[i] != block; i = (i + 1) % MAPPINGS) {
+    }
+    mappings[i] = MAPPING_GONE;
+    pthread_mutex_unlock(&mappings_lock);
+}
+
+
+/**
+ * @name    map_block
+ * @brief   Give a very large block a mapping of its own
+ *
+ * With an alignment above MM_ALIGN the user_block is placed on a multiple of
+ * it, and the whole pages before its header are unmapped again.
+ *
+ * @retval  The block or NULL if not possible
+ */
+static BlockHeader * map_block(size_t size, size_t alignment) {
+    size_t mapped;
+    size_t slack = alignment > MM_ALIGN ? alignment : 0;
+    uintptr_t start;
+    uintptr_t end;
+    BlockHeader * block;
+
+#ifdef MM_COMPACT
+    if (size >= COMPACT_RANGE - PAGE_SIZE - slack) {
+        return NULL;
+    }
+#endif
+    /* The header ends on a multiple of MM_ALIGN */
+    start = memory_map(MM_ALIGN + align_size(size) + slack, &mapped);
+    end = start + mapped;
+    block = (BlockHeader *) (start + MM_ALIGN - sizeof(BlockHeader));
+    if (start == 0) {
+        return NULL;
+    }
+    if (slack) {
+        uintptr_t aligned = ((uintptr_t) block->user_block + alignment - 1) & ~(alignment - 1);
+        block = (BlockHeader *) (aligned - sizeof(BlockHeader));
+        if (((uintptr_t) block & ~(PAGE_SIZE - 1)) > start) {
+            memory_unmap(start, ((uintptr_t) block & ~(PAGE_SIZE - 1)) - start);
+        }
+    }
+    if (!mapping_add((uintptr_t) block)) {
+        memory_unmap(mapping_start(block), end - mapping_start(block));
+        return NULL;
+    }
+    /* The next pointer marks the end of the mapping */
+    INIT_NEXT(block, end, 0x4);
+    atomic_fetch_add_explicit(&stats_mapped, end - mapping_start(block), memory_order_relaxed);
+    return block;
+}
+
+
+/**
+ * @name    unmap_block
+ * @brief   Release a block that has a mapping of its own
+ */
+static void unmap_block(BlockHeader * block) {
+    stats_use(-(ptrdiff_t) SIZE(block));
+    atomic_fetch_sub_explicit(&stats_mapped, (uintptr_t) GET_NEXT(block) - mapping_start(block),
+                              memory_order_relaxed);
+    mapping_remove((uintptr_t) block);
+    memory_unmap(mapping_start(block), (uintptr_t) GET_NEXT(block) - mapping_start(block));
+}
+
+
+/**
+ * @name    thread_alloc
+ * @brief   Allocate a block of size bytes for the calling thread, see alloc_block
+ *
+ * clean receives the high-water mark of the block's heap from before the allocation.
+ */
+static BlockHeader * thread_alloc(size_t size, size_t alignment, uintptr_t * clean) {
+    Heap * h;
+    BlockHeader * block = NULL;
+
+    /* A new mapping is all zero */
+    if (size >= MMAP_THRESHOLD) {
+        block = map_block(size, alignment);
+        *clean = (uintptr_t) block;
+    } else {
+        h = thread_heap_get();
+
+        if (h != &main_heap && size <= ARENA_LARGE) {
+            block = heap_alloc(h, size, alignment, clean);
+        }
+        if (block == NULL) {
+            block = heap_alloc(&main_heap, size, alignment, clean);
+        }
+    }
+
+    if (block != NULL) {
+        stats_use(SIZE(block));
+    }
+    return block;
+}
+
+
+/**
+ * @name    thread_objects
+ * @brief   Allocate up to n run objects of size bytes for the calling thread
+ * @retval  Number of objects allocated, stored in out
+ */
+static size_t thread_objects(size_t size, size_t n, void ** out) {
+    Heap * h = thread_heap_get();
+    size_t done = 0;
+
+    if (h != &main_heap) {
+        done = heap_objects(h, size, n, out);
+    }
+    if (done < n) {
+        done += heap_objects(&main_heap, size, n - done, out + done);
+    }
+    stats_use(done * run_size(size));
+    return done;
+}
+
+
+/**
+ * @name    cache_pop
+ * @brief   Take a block or run object for a request of size bytes from the calling thread's cache
+ * @retval  Its user block or NULL if the cache has none
+ */
+static inline void * cache_pop(size_t size) {
+    size_t aligned_size = size <= RUN_MAX_SIZE ? run_size(size) : align_size(size);
+#ifdef MM_BUDDY
+    /* Look for a block of the size the heap would hand out */
+    if (size > RUN_MAX_SIZE) {
+        aligned_size = buddy_size(aligned_size) - sizeof(BlockHeader);
+    }
+#endif
+    size_t class = CACHE_CLASS(aligned_size);
+    void * ptr;
+
+    if (class >= CACHE_CLASSES || cache.exiting) {
+        return NULL;
+    }
+    ptr = cache.head[class];
+    if (ptr != NULL) {
+        cache.head[class] = *(void **) ptr;
+        cache.count[class]--;
+        if (class > CACHE_CLASS(8)) {
+            ((void **) ptr)[1] = NULL;
+        }
+    }
+    return ptr;
+}
+
+
+/**
+ * @name    cache_holds
+ * @brief   Is the block or run object ptr of size bytes in the calling thread's cache?
+ */
+static int cache_holds(void * ptr, size_t size) {
+    void * p;
+
+    if (size > 8 && ((void **) ptr)[1] != CACHE_KEY(ptr)) {
+        return 0;
+    }
+    for (p = cache.head[CACHE_CLASS(size)]; p != NULL; p = *(void **) p) {
+        if (p == ptr) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @name    cache_push
+ * @brief   Keep an allocated small block or run object of size bytes in the calling thread's cache for reuse
+ *
+ * A full class is first flushed to the heaps. After thread_exit the block
+ * goes straight back to its heap. A block that is in the cache already has
+ * been freed twice and is left there.
+ */
+static inline void cache_push(void * ptr, size_t size) {
+    int class = CACHE_CLASS(size);
+    void ** entry = ptr;
+
+    thread_register();
+    if (cache.exiting) {
+        heap_release(ptr);
+        return;
+    }
+    if (cache_holds(ptr, size)) {
+        return;
+    }
+    if (cache.count[class] == CACHE_LIMIT) {
+        cache_flush(&cache, class);
+    }
+    entry[0] = cache.head[class];
+    if (size > 8) {
+        entry[1] = CACHE_KEY(ptr);
+    }
+    cache.head[class] = ptr;
+    cache.count[class]++;
+}
+
+
+/**
+ * @name    simple_malloc
+ * @brief   Allocate at least size contiguous bytes of memory and return a pointer to the first byte.
+ *
+ * This function should behave similar to a normal malloc implementation.
+ *
+ * @param size_t size Number of bytes to allocate.
+ * @retval Pointer to the start of the allocated memory or NULL if not possible.
+ *
+ */
+void* simple_malloc(size_t size) {
+    BlockHeader * block;
+    uintptr_t clean;
+    void * ptr;
+
+    thread_register();
+    stats_call(&cache.mallocs);
+    if (too_large(size)) {
+        stats_call(&cache.failed);
+        return NULL;
+    }
+
+    /* Small requests are served from the thread cache when possible, then from runs */
+    if (size <= CACHE_MAX_SIZE) {
+        ptr = cache_pop(size);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+    if (size <= RUN_MAX_SIZE && thread_objects(size, 1, &ptr) == 1) {
+        return ptr;
+    }
+
+    block = thread_alloc(size, 0, &clean);
+    if (block == NULL) {
+        stats_call(&cache.failed);
+        return NULL;
+    }
+    return (void *) block->user_block;
+}
+
+
+/**
+ * @name    simple_memalign
+ * @brief   Allocate at least size bytes starting on a multiple of alignment.
+ *
+ * This function should behave similar to a normal memalign implementation.
+ * The gap in front of the aligned block is returned to the heap as a free
+ * block, and the result can be passed to simple_free and simple_realloc.
+ *
+ * @param size_t alignment A power of two.
+ * @param size_t size Number of bytes to allocate.
+ * @retval Pointer to the start of the allocated memory or NULL if not possible;
+ *         errno is EINVAL if alignment is not a power of two.
+ *
+ */
+void * simple_memalign(size_t alignment, size_t size) {
+    BlockHeader * block;
+    uintptr_t clean;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= MM_ALIGN) {
+        return simple_malloc(size);
+    }
+
+    thread_register();
+    stats_call(&cache.mallocs);
+    if (too_large(size) || too_large(alignment)) {
+        stats_call(&cache.failed);
+        return NULL;
+    }
+    block = thread_alloc(size, alignment, &clean);
+    if (block == NULL) {
+        stats_call(&cache.failed);
+        return NULL;
+    }
+    return (void *) block->user_block;
+}
+
+
+/**
+ * @name    simple_aligned_alloc
+ * @brief   Allocate at least size bytes starting on a multiple of alignment, as C11 aligned_alloc.
+ */
+void * simple_aligned_alloc(size_t alignment, size_t size) {
+    return simple_memalign(alignment, size);
+}
+
+
+/**
+ * @name    simple_calloc
+ * @brief   Allocate zeroed memory for an array of nmemb elements of size bytes each.
+ *
+ * This function should behave similar to a normal calloc implementation.
+ * Memory above the high-water mark has never been used and is still zero,
+ * so only the part of the block below the mark is cleared. The buddy engine
+ * writes the header of every buddy a heap is cut into, which puts the mark
+ * at the top of the heap, so there blocks are always cleared whole.
+ *
+ * @param size_t nmemb Number of elements.
+ * @param size_t size Size of each element in bytes.
+ * @retval Pointer to the start of the zeroed memory or NULL if not possible (also on overflow).
+ *
+ */
+void * simple_calloc(size_t nmemb, size_t size) {
+    size_t total;
+    BlockHeader * block;
+    uintptr_t clean;
+    void * ptr;
+
+    thread_register();
+    stats_call(&cache.mallocs);
+    if (__builtin_mul_overflow(nmemb, size, &total) || too_large(total)) {
+        errno = ENOMEM;
+        stats_call(&cache.failed);
+        return NULL;
+    }
+
+    /* Cached blocks and run objects have been used before */
+    if (total <= CACHE_MAX_SIZE) {
+        ptr = cache_pop(total);
+        if (ptr == NULL && total <= RUN_MAX_SIZE) {
+            thread_objects(total, 1, &ptr);
+        }
+        if (ptr != NULL) {
+            memset(ptr, 0, total);
+            return ptr;
+        }
+    }
+
+    block = thread_alloc(total, 0, &clean);
+    if (block == NULL) {
+        stats_call(&cache.failed);
+        return NULL;
+    }
+
+    uintptr_t start = (uintptr_t) block->user_block;
+    uintptr_t end   = (uintptr_t) GET_NEXT(block);
+    if (end <= clean) {
+        /* Entirely reused memory */
+        memset((void *) start, 0, end - start);
+    } else {
+        /* Clear up to the mark, and the footer that may sit just before the end header */
+        if (start < clean) {
+            memset((void *) start, 0, clean - start);
+        }
+        ((Footer *) end)[-1] = 0;
+    }
+    return (void *) start;
+}
+
+
+/**
+ * @name    simple_malloc_batch
+ * @brief   Allocate n blocks of at least size bytes each.
+ *
+ * Small blocks are taken from the thread cache first, and run objects from
+ * their runs under one lock. The others are carved from as few free blocks
+ * as possible, taking each heap's lock once, see heap_alloc_batch. Each block is freed on its own or with simple_free_batch.
+ *
+ * @param size_t size Number of bytes to allocate per block.
+ * @param size_t n Number of blocks.
+ * @param void **out Array receiving the n pointers.
+ * @retval Number of blocks allocated, less than n if not possible (the first ones are then stored).
+ *
+ */
+size_t simple_malloc_batch(size_t size, size_t n, void ** out) {
+    BlockHeader * block;
+    Heap * h;
+    size_t done = 0;
+    void * ptr;
+
+    thread_register();
+    atomic_store_explicit(&cache.mallocs, atomic_load_explicit(&cache.mallocs, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+    if (too_large(size)) {
+        atomic_store_explicit(&cache.failed, atomic_load_explicit(&cache.failed, memory_order_relaxed) + n,
+                              memory_order_relaxed);
+        return 0;
+    }
+
+    if (size <= CACHE_MAX_SIZE) {
+        while (done < n && (ptr = cache_pop(size)) != NULL) {
+            out[done++] = ptr;
+        }
+    }
+    if (size <= RUN_MAX_SIZE && done < n) {
+        done += thread_objects(size, n - done, out + done);
+    }
+
+    if (size >= MMAP_THRESHOLD) {
+        while (done < n && (block = map_block(size, 0)) != NULL) {
+            stats_use(SIZE(block));
+            out[done++] = (void *) block->user_block;
+        }
+    } else if (done < n) {
+        h = thread_heap_get();
+        if (h != &main_heap && size <= ARENA_LARGE) {
+            done += heap_alloc_batch(h, size, n - done, out + done);
+        }
+        if (done < n) {
+            done += heap_alloc_batch(&main_heap, size, n - done, out + done);
+        }
+    }
+
+    if (done < n) {
+        atomic_store_explicit(&cache.failed, atomic_load_explicit(&cache.failed, memory_order_relaxed) + n - done,
+                              memory_order_relaxed);
+    }
+    return done;
+}
+
+
+/**
+ * @name    simple_free
+ * @brief   Frees previously allocated memory and makes it available for subsequent calls to simple_malloc
+ *
+ * This function should behave similar to a normal free implementation.
+ *
+ * @param void *ptr Pointer to the memory to free.
+ *
+ */
+void simple_free(void * ptr) {
+    /* Memory from elsewhere is left alone */
+    if (ptr == NULL || !simple_owns(ptr)) {
+        return;
+    }
+
+    /* Run objects have no header, their run is found from the address */
+    Run * run = run_of(ptr);
+    if (run != NULL) {
+        if (!run_used(run, ptr)) {
+            /* Object is not in use -- probably an error */
+            return;
+        }
+        thread_register();
+        stats_call(&cache.frees);
+        cache_push(ptr, run->size);
+        return;
+    }
+
+    BlockHeader * block = ptr - sizeof(BlockHeader); /* Find block corresponding to ptr */
+    if (GET_FREE(block)) {
+        /* Block is not in use -- probably an error */
+        return;
+    }
+
+    thread_register();
+    stats_call(&cache.frees);
+
+    if (GET_MAPPED(block)) {
+        unmap_block(block);
+        return;
+    }
+
+    /* Small blocks go to the thread cache */
+    if (SIZE(block) <= CACHE_MAX_SIZE) {
+        cache_push(ptr, SIZE(block));
+        return;
+    }
+
+    heap_release(ptr);
+}
+
+
+/**
+ * @name    compare_address
+ * @brief   Order pointers by address, for qsort
+ */
+static int compare_address(const void * a, const void * b) {
+    uintptr_t x = (uintptr_t) *(void * const *) a;
+    uintptr_t y = (uintptr_t) *(void * const *) b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * @name    release_locked
+ * @brief   Give an allocated block or run object back to its heap h, given its user block
+ *
+ * locked is the heap whose lock the caller holds, if any. The lock of h is
+ * kept for the next call, which likely gives back to the same heap.
+ *
+ * @retval  The heap now locked, or NULL
+ */
+static Heap * release_locked(void * ptr, Heap * h, Heap * locked) {
+    if (h != &main_heap && h != thread_heap) {
+        remote_push(h, ptr);
+        return locked;
+    }
+    if (h != locked) {
+        if (locked != NULL) {
+            pthread_mutex_unlock(&locked->lock);
+        }
+        pthread_mutex_lock(&h->lock);
+    }
+    heap_free(h, ptr);
+    return h;
+}
+
+
+/**
+ * @name    simple_free_batch
+ * @brief   Free n blocks at once, as simple_free does for each of them.
+ *
+ * The pointers are sorted by address, so blocks lying next to each other
+ * form spans that are merged into one block by rewriting a single header,
+ * and given back with one free_block each. Headers are only rewritten under
+ * the lock of their heap, and consecutive spans and run objects of the same
+ * heap share one acquisition of it. Blocks of other threads' arenas go on
+ * their remote stacks one by one, as simple_free does. The blocks bypass
+ * the thread cache.
+ *
+ * @param void **ptrs Pointers to free, NULL and repeated ones are skipped. The array is reordered.
+ * @param size_t n Number of pointers.
+ *
+ */
+void simple_free_batch(void ** ptrs, size_t n) {
+    BlockHeader * span = NULL;
+    Heap * locked = NULL;
+    Heap * h;
+    size_t bytes = 0;
+    size_t i;
+
+    thread_register();
+    qsort(ptrs, n, sizeof(void *), compare_address);
+
+    for (i = 0; i < n; i++) {
+        BlockHeader * block;
+        Run * run;
+
+        /* Memory from elsewhere is left alone */
+        if (ptrs[i] == NULL || (i > 0 && ptrs[i] == ptrs[i - 1]) || !simple_owns(ptrs[i])) {
+            continue;
+        }
+        if ((run = run_of(ptrs[i])) != NULL) {
+            if (!run_used(run, ptrs[i]) || cache_holds(ptrs[i], run->size)) {
+                continue;
+            }
+            stats_call(&cache.frees);
+            bytes += run->size;
+            locked = release_locked(ptrs[i], run->heap, locked);
+            continue;
+        }
+        block = ptrs[i] - sizeof(BlockHeader);
+        if (GET_FREE(block) || (SIZE(block) <= CACHE_MAX_SIZE && cache_holds(ptrs[i], SIZE(block)))) {
+            continue;
+        }
+        stats_call(&cache.frees);
+
+        if (GET_MAPPED(block)) {
+            unmap_block(block);
+            continue;
+        }
+        bytes += SIZE(block);
+
+        /* The owner of another arena may be rewriting the headers around the block */
+        h = heap_of(block);
+        if (h != &main_heap && h != thread_heap) {
+            remote_push(h, ptrs[i]);
+            continue;
+        }
+        /* Headers are only rewritten under the lock of their heap */
+        if (span != NULL && heap_of(span) != h) {
+            locked = release_locked(span->user_block, heap_of(span), locked);
+            span = NULL;
+        }
+        if (h != locked) {
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&h->lock);
+            locked = h;
+        }
+
+        /* A block right after the span joins it, its header becomes part of the span */
+        if (span != NULL && GET_NEXT(span) == block) {
+            SET_NEXT(span, GET_NEXT(block));
+            continue;
+        }
+        if (span != NULL) {
+            locked = release_locked(span->user_block, heap_of(span), locked);
+        }
+        span = block;
+    }
+    if (span != NULL) {
+        locked = release_locked(span->user_block, heap_of(span), locked);
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+    stats_use(-(ptrdiff_t) bytes);
+}
+
+
+/**
+ * @name    simple_realloc
+ * @brief   Resize previously allocated memory, preserving its contents.
+ *
+ * This function should behave similar to a normal realloc implementation.
+ * Shrinking splits off the tail of the block, and growing absorbs a free
+ * block following it. Only when that is not enough is the data moved to a
+ * new block.
+ *
+ * @param void *ptr Pointer to the memory to resize, or NULL to allocate.
+ * @param size_t size New size in bytes, or 0 to free.
+ * @retval Pointer to the resized memory or NULL if not possible (ptr is then untouched).
+ *
+ */
+void * simple_realloc(void * ptr, size_t size) {
+    if (ptr == NULL) {
+        return simple_malloc(size);
+    }
+    if (size == 0) {
+        simple_free(ptr);
+        return NULL;
+    }
+    if (too_large(size)) {
+        /* The block stays as it is */
+        return NULL;
+    }
+
+    /* A run object is kept if its class is large enough, and otherwise moved */
+    Run * run = run_of(ptr);
+    if (run != NULL) {
+        if (size <= run->size) {
+            return ptr;
+        }
+        void * new_ptr = simple_malloc(size);
+        if (new_ptr == NULL) {
+            return NULL;
+        }
+        memcpy(new_ptr, ptr, run->size);
+        simple_free(ptr);
+        return new_ptr;
+    }
+
+    BlockHeader * block = ptr - sizeof(BlockHeader); /* Find block corresponding to ptr */
+    size_t aligned_size = align_size(size);
+    size_t old_size = SIZE(block);
+    Heap * h;
+
+    /* A mapped block is kept if it is large enough, and otherwise remapped */
+    if (GET_MAPPED(block)) {
+        size_t mapped;
+        uintptr_t start;
+        if (aligned_size <= SIZE(block)) {
+            return ptr;
+        }
+#ifdef MM_COMPACT
+        if (aligned_size >= COMPACT_RANGE - PAGE_SIZE) {
+            return NULL;
+        }
+#endif
+        uintptr_t offset = (uintptr_t) block - mapping_start(block);
+        size_t old_mapped = (uintptr_t) GET_NEXT(block) - mapping_start(block);
+        start = memory_remap(mapping_start(block), old_mapped,
+                             offset + sizeof(BlockHeader) + aligned_size, &mapped);
+        if (start == 0) {
+            return NULL;
+        }
+        if (start != mapping_start(block)) {
+            /* Moved: the old header leaves a free slot for the new one */
+            mapping_remove((uintptr_t) block);
+            mapping_add(start + offset);
+        }
+        block = (BlockHeader *) (start + offset);
+        INIT_NEXT(block, start + mapped, 0x4);
+        atomic_fetch_add_explicit(&stats_mapped, mapped - old_mapped, memory_order_relaxed);
+        stats_use(SIZE(block) - old_size);
+        return (void *) block->user_block;
+    }
+
+    h = heap_of(block);
+    pthread_mutex_lock(&h->lock);
+
+    /* Grow in place by absorbing a following free block */
+    if (aligned_size > SIZE(block)) {
+        BlockHeader * next = GET_NEXT(block);
+        if (GET_FREE(next) && SIZE(block) + sizeof(BlockHeader) + SIZE(next) >= aligned_size) {
+            bin_remove(h, next);
+            SET_NEXT(block, GET_NEXT(next));
+            next = GET_NEXT(block);
+            SET_PREV_FREE(next, 0);
+            mark_written(h, next);
+        }
+    }
+
+    /* Shrink in place, giving any unused tail back */
+    if (aligned_size <= SIZE(block)) {
+        split_block(h, block, aligned_size);
+        pthread_mutex_unlock(&h->lock);
+        stats_use(SIZE(block) - old_size);
+        return ptr;
+    }
+
+    pthread_mutex_unlock(&h->lock);
+
+    /* Move and copy */
+    void * new_ptr = simple_malloc(size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, SIZE(block));
+    simple_free(ptr);
+    return new_ptr;
+}
+
+
+/**
+ * @name    simple_owns
+ * @brief   Tell pointers returned by the allocator from memory of other allocators
+ *
+ * Heap blocks lie in the address range reserved by memory_setup, which never
+ * moves. Any other block of ours has a mapping of its own, and its header
+ * is in the mapping registry. Neither check reads memory at ptr, so it is
+ * safe for any pointer.
+ *
+ * @param void *ptr Any pointer.
+ * @retval 1 if ptr lies in the heap's range or is the user_block of a mapped block, 0 otherwise.
+ */
+int simple_owns(void * ptr) {
+    uintptr_t p = (uintptr_t) ptr;
+    int found;
+
+    if (p >= memory_start && p < memory_limit) {
+        return 1;
+    }
+    if ((p & 0x7) != 0 || p < sizeof(BlockHeader)) {
+        return 0;
+    }
+    pthread_mutex_lock(&mappings_lock);
+    found = mapping_find(p - sizeof(BlockHeader));
+    pthread_mutex_unlock(&mappings_lock);
+    return found;
+}
+
+
+/**
+ * @name    simple_usable_size
+ * @brief   Number of bytes available to the user in an allocated block
+ *
+ * This may be more than was requested, and all of it may be used.
+ *
+ * @param void *ptr Pointer returned by simple_malloc or simple_realloc, or NULL.
+ * @retval Usable size in bytes, 0 for NULL.
+ */
+size_t simple_usable_size(void * ptr) {
+    Run * run;
+
+    if (ptr == NULL) {
+        return 0;
+    }
+    if ((run = run_of(ptr)) != NULL) {
+        return run->size;
+    }
+    BlockHeader * block = ptr - sizeof(BlockHeader); /* Find block corresponding to ptr */
+    return SIZE(block);
+}
+
+
+/**
+ * @name    simple_trim
+ * @brief   Give the pages of all free blocks back to the system
+ *
+ * The calling thread's cache is flushed first, so its blocks can merge with
+ * their free neighbours. Blocks in the caches of other threads stay there.
+ *
+ * @retval  Number of resident bytes given back
+ */
+size_t simple_trim(void) {
+    int n = atomic_load_explicit(&arena_count, memory_order_acquire);
+    size_t released = 0;
+    int class;
+    int i;
+
+    for (class = 0; class < CACHE_CLASSES; class++) {
+        cache_flush(&cache, class);
+    }
+    for (i = -1; i < n; i++) {
+        Heap * h = i < 0 ? &main_heap : &arenas[i];
+        BlockHeader * block;
+
+        pthread_mutex_lock(&h->lock);
+        remote_drain(h);
+        for (block = h->first; block != NULL && block != h->last; block = GET_NEXT(block)) {
+            if (GET_FREE(block)) {
+                released += trim_block(h, block, 0, UINTPTR_MAX);
+            }
+        }
+        pthread_mutex_unlock(&h->lock);
+    }
+    return released;
+}
+
+
+
+/*
+ * Heap handles
+ *
+ * simple_heap_create puts a heap over a buffer of the caller's, with the
+ * Heap at its start, so a subsystem can keep its blocks together and apart
+ * from everybody else's. Such a heap is used only through the simple_heap
+ * calls: its blocks go straight to and from its bins under its lock, without
+ * thread caches, runs, arenas or mappings, and it does not grow. Its free
+ * blocks are not trimmed either, as the buffer is not the allocator's to
+ * give back. It shares nothing with the other heaps, not even the
+ * statistics of simple_mallinfo, so heaps used by different threads never
+ * contend. The default heap is the
+ * main heap, and the simple_heap calls on it are the plain simple_ calls.
+ */
+
+/**
+ * @name    simple_heap_create
+ * @brief   Set up a heap over the size bytes at buffer
+ * @retval  The heap or NULL if the buffer has no room for a block, or with
+ *          compact headers spans COMPACT_RANGE or more
+ *
+ * Nothing is known about the buffer's contents, so all of it counts as
+ * written, see mark_written.
+ */
+Heap * simple_heap_create(void * buffer, size_t size) {
+    uintptr_t start = ((uintptr_t) buffer + _Alignof(Heap) - 1) & ~(_Alignof(Heap) - 1);
+    uintptr_t end = (uintptr_t) buffer + size;
+    Heap * h = (Heap *) start;
+
+    if (buffer == NULL || end < (uintptr_t) buffer || end < start || end - start < sizeof(Heap)) {
+        return NULL;
+    }
+#ifdef MM_COMPACT
+    if (end - start >= COMPACT_RANGE) {
+        return NULL;
+    }
+#endif
+    memset(h, 0, sizeof(Heap));
+    h->borrowed = 1;
+    pthread_mutex_init(&h->lock, NULL);
+    heap_init(h, start + sizeof(Heap), end, end);
+    if (h->first == NULL) {
+        pthread_mutex_destroy(&h->lock);
+        return NULL;
+    }
+    return h;
+}
+
+
+/**
+ * @name    simple_heap_default
+ * @brief   The main heap, behind simple_malloc and simple_free
+ */
+Heap * simple_heap_default(void) {
+    return &main_heap;
+}
+
+
+/**
+ * @name    simple_heap_malloc
+ * @brief   Allocate at least size bytes from heap
+ * @retval  Pointer to the memory or NULL if not possible
+ */
+void * simple_heap_malloc(Heap * heap, size_t size) {
+    BlockHeader * block;
+
+    if (heap == &main_heap) {
+        return simple_malloc(size);
+    }
+    if (too_large(size)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&heap->lock);
+    block = alloc_block(heap, size, 0, NULL);
+    pthread_mutex_unlock(&heap->lock);
+    return block != NULL ? (void *) block->user_block : NULL;
+}
+
+
+/**
+ * @name    simple_heap_free
+ * @brief   Free memory allocated from heap
+ *
+ * Pointers outside the heap's range and blocks already free are left alone.
+ */
+void simple_heap_free(Heap * heap, void * ptr) {
+    BlockHeader * block = (BlockHeader *) ptr - 1;
+
+    if (heap == &main_heap) {
+        simple_free(ptr);
+        return;
+    }
+    if ((uintptr_t) block < (uintptr_t) heap->first || (uintptr_t) block >= (uintptr_t) heap->last) {
+        return;
+    }
+    pthread_mutex_lock(&heap->lock);
+    if (!GET_FREE(block)) {
+        free_block(heap, block);
+    }
+    pthread_mutex_unlock(&heap->lock);
+}
+
+
+/**
+ * @name    simple_heap_destroy
+ * @brief   Release what heap holds apart from its buffer
+ *
+ * Nothing is done for the default heap.
+ */
+void simple_heap_destroy(Heap * heap) {
+    if (heap == &main_heap) {
+        return;
+    }
+#ifdef MM_BITMAP
+    bitmap_free(heap);
+#endif
+    pthread_mutex_destroy(&heap->lock);
+}
+
+#include "mm_aux.c"
+
+#ifdef MM_TRACE
+#include "mm_trace.c"
+#else
+void simple_trace_flush(void) {
+}
+#endif
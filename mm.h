@@ -26,18 +26,364 @@ void * simple_malloc(size_t size);
 void simple_free(void * ptr);
 
 
+/**
+ * @name    simple_memalign
+ * @brief   Allocate at least size bytes starting on a multiple of alignment (a power of two).
+ * @retval  Pointer to the start of the allocated memory or NULL if not possible. Free it with simple_free.
+ */
+void * simple_memalign(size_t alignment, size_t size);
+
+
+/**
+ * @name    simple_aligned_alloc
+ * @brief   Same as simple_memalign, under the C11 name.
+ */
+void * simple_aligned_alloc(size_t alignment, size_t size);
+
+
+/**
+ * @name    simple_calloc
+ * @brief   Allocate zeroed memory for nmemb elements of size bytes each.
+ * @retval  Pointer to the start of the allocated memory or NULL if not possible or nmemb * size overflows.
+ */
+void * simple_calloc(size_t nmemb, size_t size);
+
+
+/**
+ * @name    simple_realloc
+ * @brief   Resize previously allocated memory in place if possible, otherwise move it.
+ * @retval  Pointer to the resized memory or NULL if not possible (the old memory is then untouched).
+ */
+void * simple_realloc(void * ptr, size_t size);
+
+
+/**
+ * @name    simple_malloc_batch
+ * @brief   Allocate n blocks of at least size bytes each, storing pointers to them in out.
+ * @retval  Number of blocks allocated, less than n if not possible.
+ */
+size_t simple_malloc_batch(size_t size, size_t n, void ** out);
+
+
+/**
+ * @name    simple_free_batch
+ * @brief   Free n blocks at once, merging those that lie next to each other. The array is reordered.
+ */
+void simple_free_batch(void ** ptrs, size_t n);
+
+
+/**
+ * @name    simple_owns
+ * @brief   Was ptr returned by the allocator (and not freed since, for very large blocks)?
+ * @retval  1 if so, 0 for memory from elsewhere
+ */
+int simple_owns(void * ptr);
+
+
+/**
+ * @name    simple_usable_size
+ * @brief   Number of bytes that may be used in an allocated block (at least the requested size).
+ */
+size_t simple_usable_size(void * ptr);
+
+
+/**
+ * @name    simple_trim
+ * @brief   Give the pages of all free blocks back to the system. They fault back in on reuse.
+ * @retval  Number of resident bytes given back, always 0 on hugetlbfs pages (see simple_set_huge_pages)
+ */
+size_t simple_trim(void);
+
+
+/**
+ * @name    Pool
+ * @brief   A pool of fixed-size objects, see mm_pool.c
+ */
+typedef struct pool Pool;
+
+
+/**
+ * @name    simple_pool_create
+ * @brief   Create a pool handing out objects of size bytes each, without per-object headers.
+ * @retval  The pool or NULL if not possible.
+ */
+Pool * simple_pool_create(size_t size);
+
+
+/**
+ * @name    simple_pool_alloc
+ * @brief   Allocate one object from the pool in O(1).
+ * @retval  Pointer to the object or NULL if not possible.
+ */
+void * simple_pool_alloc(Pool * pool);
+
+
+/**
+ * @name    simple_pool_free
+ * @brief   Return an object to the pool it was allocated from in O(1).
+ */
+void simple_pool_free(Pool * pool, void * ptr);
+
+
+/**
+ * @name    simple_pool_destroy
+ * @brief   Release the pool and all memory it holds, including objects not yet freed.
+ */
+void simple_pool_destroy(Pool * pool);
+
+
+/**
+ * @name    Region
+ * @brief   A bump-pointer region for allocations sharing one lifetime, see mm_region.c
+ */
+typedef struct region Region;
+
+/**
+ * @name    RegionMark
+ * @brief   A position in a region to reset to
+ */
+typedef struct region_mark {
+    void * chunk;
+    char * bump;
+} RegionMark;
+
+
+/**
+ * @name    simple_region_create
+ * @brief   Create an empty region.
+ * @retval  The region or NULL if not possible.
+ */
+Region * simple_region_create(void);
+
+
+/**
+ * @name    simple_region_alloc
+ * @brief   Allocate size bytes from the region by bumping a pointer.
+ * @retval  Pointer to 8-byte aligned memory or NULL if not possible.
+ */
+void * simple_region_alloc(Region * region, size_t size);
+
+
+/**
+ * @name    simple_region_mark
+ * @brief   Record the current position of the region.
+ */
+RegionMark simple_region_mark(Region * region);
+
+
+/**
+ * @name    simple_region_reset
+ * @brief   Release everything allocated from the region since mark was taken, at once.
+ */
+void simple_region_reset(Region * region, RegionMark mark);
+
+
+/**
+ * @name    simple_region_destroy
+ * @brief   Release the region and everything allocated from it.
+ */
+void simple_region_destroy(Region * region);
+
+
+/**
+ * @name    Heap
+ * @brief   An independent heap over a buffer of the caller's, see simple_heap_create
+ */
+typedef struct heap Heap;
+
+
+/**
+ * @name    simple_heap_create
+ * @brief   Set up a heap managing the size bytes at buffer, which must stay valid while the heap is used.
+ *          The heap's own bookkeeping takes the start of the buffer (under 10 KB), and it never grows.
+ * @retval  The heap or NULL if the buffer is too small, or 2 GB or more with compact headers.
+ */
+Heap * simple_heap_create(void * buffer, size_t size);
+
+
+/**
+ * @name    simple_heap_default
+ * @brief   The heap behind simple_malloc and simple_free.
+ */
+Heap * simple_heap_default(void);
+
+
+/**
+ * @name    simple_heap_malloc
+ * @brief   Allocate at least size bytes from heap, 8-byte aligned.
+ * @retval  Pointer to the memory or NULL if not possible.
+ */
+void * simple_heap_malloc(Heap * heap, size_t size);
+
+
+/**
+ * @name    simple_heap_free
+ * @brief   Free memory allocated from heap. Pointers from elsewhere are left alone.
+ */
+void simple_heap_free(Heap * heap, void * ptr);
+
+
+/**
+ * @name    simple_heap_dump
+ * @brief   Dump the blocks of heap on standard out.
+ */
+void simple_heap_dump(Heap * heap);
+
+
+/**
+ * @name    simple_heap_destroy
+ * @brief   Release what the heap holds apart from its buffer, which goes back to the caller with everything in it.
+ */
+void simple_heap_destroy(Heap * heap);
+
+
+/**
+ * @name    Trace file format
+ * @brief   Records written by a build with tracing (make TRACE=1), see mm_trace.c
+ *
+ * The file starts with a TraceFileHeader followed by TraceRecords. Records of
+ * one thread are in call order, those of different threads are interleaved
+ * in chunks.
+ */
+#define TRACE_MAGIC     "MMTRACE"
+
+enum trace_op {
+    TRACE_MALLOC = 1,
+    TRACE_FREE,
+    TRACE_CALLOC,         // size is nmemb * size, arg is nmemb
+    TRACE_REALLOC,        // arg is the old address
+    TRACE_MEMALIGN        // arg is the alignment
+};
+
+typedef struct trace_file_header {
+    char magic[8];        // TRACE_MAGIC
+    uint32_t record_size; // sizeof(TraceRecord)
+    uint32_t reserved;
+} TraceFileHeader;
+
+typedef struct trace_record {
+    uint64_t tsc;         // Time stamp counter when the call returned (before it for free)
+    uint64_t addr;        // Address returned, or freed
+    uint64_t arg;         // Depends on op
+    uint32_t size;        // Requested size, UINT32_MAX if larger
+    uint16_t thread;      // Thread number, reused after a thread exits
+    uint8_t op;           // enum trace_op
+    uint8_t reserved;
+} TraceRecord;
+
+
+/**
+ * @name    simple_trace_flush
+ * @brief   Write the trace records of the calling thread and of exited threads. Called at exit.
+ *
+ * Does nothing unless built with tracing.
+ */
+void simple_trace_flush(void);
+
+
+/**
+ * @name    simple_set_heap_size
+ * @brief   Set the initial heap size (default 32 MB). Only possible before the first allocation.
+ * @retval  0 if ok, -1 if the heap is already set up
+ */
+int simple_set_heap_size(size_t size);
+
+
+/**
+ * @name    simple_set_huge_pages
+ * @brief   Back the heap with 2 MB pages (on = 1) or 4 KB pages (on = 0, the default), see memory_setup.c.
+ *          Only possible before the first allocation. The MM_HUGE_PAGES environment variable overrides it.
+ * @retval  0 if ok, -1 if the heap is already set up
+ */
+int simple_set_huge_pages(int on);
+
+
 /**
  * @name    The lowest address of the memory you will manage
  * @brief   This points to the lowest address of memory you will manage
  */
-extern const uintptr_t memory_start;
+extern uintptr_t memory_start;
 
 
 /**
  * @name    The limit of the memory you will manage
- * @brief   This points to the first address of memory you will NOT manage
+ * @brief   This points to the first address of memory you will NOT manage. It moves up as the heap grows.
+ */
+extern uintptr_t memory_end;
+
+
+/**
+ * @name    The limit of the reserved address range
+ * @brief   The heap can grow up to here. Set once by memory_setup.
  */
-extern const uintptr_t memory_end;
+extern uintptr_t memory_limit;
+
+
+/**
+ * @name    memory_page
+ * @brief   Size of the pages the heap grows and is given back by, 4 KB or 2 MB. Set once by memory_setup.
+ */
+extern size_t memory_page;
+
+
+/**
+ * @name    memory_huge
+ * @brief   Which huge pages back the heap. Set once by memory_setup.
+ */
+enum huge_pages {
+    HUGE_NONE,            // 4 KB pages
+    HUGE_TRANSPARENT,     // Transparent huge pages, advised with MADV_HUGEPAGE
+    HUGE_TLB              // hugetlbfs pages, mapped with MAP_HUGETLB
+};
+
+extern int memory_huge;
+
+
+/**
+ * @name    memory_setup
+ * @brief   Reserve the heap's address range and set memory_start and memory_end
+ * @retval  0 if ok, -1 if not possible
+ */
+int memory_setup(void);
+
+
+/**
+ * @name    memory_grow
+ * @brief   Make at least size more bytes accessible at memory_end
+ * @retval  The new memory_end, or 0 if not possible
+ */
+uintptr_t memory_grow(size_t size);
+
+
+/**
+ * @name    memory_map
+ * @brief   Map a separate zeroed range of at least size bytes for a very large block
+ * @retval  Start of the range, or 0 if not possible. *mapped receives its size.
+ */
+uintptr_t memory_map(size_t size, size_t * mapped);
+
+
+/**
+ * @name    memory_remap
+ * @brief   Resize a range obtained with memory_map to at least size bytes, moving it if needed
+ * @retval  Start of the range, or 0 if not possible. *mapped receives its size.
+ */
+uintptr_t memory_remap(uintptr_t start, size_t old_size, size_t size, size_t * mapped);
+
+
+/**
+ * @name    memory_unmap
+ * @brief   Release a range obtained with memory_map
+ */
+void memory_unmap(uintptr_t start, size_t size);
+
+
+/**
+ * @name    memory_release
+ * @brief   Give the pages of a page-aligned range back to the system, to be faulted in again zeroed
+ * @retval  Number of bytes of the range that were resident
+ */
+size_t memory_release(uintptr_t start, size_t size);
 
 /**
  * @name    simple_macro_test
@@ -46,6 +392,43 @@ extern const uintptr_t memory_end;
  */
 int simple_macro_test(void);
 
+/**
+ * @name    simple_search_visits
+ * @brief   Number of free blocks visited by simple_malloc searches so far
+ */
+size_t simple_search_visits(void);
+
+
+#define MALLOC_SEARCH_BUCKETS (8)
+
+/**
+ * @name    MallocInfo
+ * @brief   Heap statistics, see simple_mallinfo
+ */
+typedef struct malloc_info {
+    size_t in_use;          // Bytes available to the user in allocated blocks, including thread caches
+    size_t peak_in_use;     // Largest in_use so far
+    size_t footprint;       // Bytes held from the system: the heap and the mappings of very large blocks
+    size_t released;        // Resident bytes of free blocks given back to the system so far, see simple_trim
+    size_t free;            // Bytes in free blocks, headers included
+    size_t free_blocks;     // Number of free blocks
+    size_t largest_free;    // Size of the largest free block, header included, not a counter
+    double fragmentation;   // 1 - largest_free / free, 0 when free memory is one block (or none)
+    size_t mallocs;         // Calls allocating memory, simple_realloc only when it moves
+    size_t frees;           // Calls freeing memory
+    size_t failed;          // Allocating calls that returned NULL
+    size_t search_histogram[MALLOC_SEARCH_BUCKETS];  // Searches by free blocks visited: 0, 1, 2-3, 4-7, ..., 64+
+} MallocInfo;
+
+
+/**
+ * @name    simple_mallinfo
+ * @brief   Collect heap statistics from counters kept up to date by the allocator.
+ *          Only largest_free (and fragmentation) is looked up instead, at the cost of a walk of the
+ *          largest free blocks of every heap, see mm_aux.c.
+ */
+MallocInfo simple_mallinfo(void);
+
 /**
  * @name    simple_block_dump
  * @brief   Dumps the current list of blocks on standard out
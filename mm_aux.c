@@ -10,13 +10,23 @@
 int simple_macro_test() {
   BlockHeader block;
   BlockHeader * p = &block;
-  void * addr[2] = { (void *)  0x1234BABA, (void *) 0xFEDCBA981234BABA };
+#ifndef MM_COMPACT
+  /* Block addresses are 8-byte aligned, leaving the low 3 bits for flags */
+  void * addr[2] = { (void *)  0x1234BAB8, (void *) 0xFEDCBA981234BAB8 };
+  void * none = NULL;
+#else
+  /* Offsets from the header are multiples of 8 and fit in 32 bits with their sign */
+  void * addr[2] = { (void *) ((uintptr_t) p + 0x1234BAB8), (void *) ((uintptr_t) p - 0x7FFFFFF8) };
+  void * none = p;
+
+  if (sizeof(BlockHeader) != 4) return 30;  // Header not packed
+#endif
   int i;
   int ret = 0;
 
-  /* Test separately for 32 and 64 bit addresses */
+  /* Test separately for forward and backward (compact) or 32 and 64 bit addresses */
   for (i =0; i < 2; i++) {
-    p->next = NULL;
+    INIT_NEXT(p, none, 0);
     /* Check that next and free are properly separated */
     SET_NEXT(p, addr[i]);
     SET_FREE(p, 7);  /* only least bit should be used */
@@ -24,7 +34,7 @@ int simple_macro_test() {
     if (GET_NEXT(p) != addr[i]) return 1 + i*10;  // Next pointer damaged
     if (GET_FREE(p) != 1)       return 2 + i*10;  // Free flag not set
 
-    SET_NEXT(p, NULL);
+    SET_NEXT(p, none);
     if (GET_FREE(p) != 1)       return 3 + i*10;  // Free flag damaged
 
     SET_NEXT(p, addr[i]);
@@ -33,6 +43,16 @@ int simple_macro_test() {
     if (GET_FREE(p) != 0)       return 4 + i*10;  // Free flag not cleared
     if (GET_NEXT(p) != addr[i]) return 5 + i*10;  // Next pointer damaged
 
+    /* Check that the prev free flag is separate from next and free */
+    SET_PREV_FREE(p, 1);
+    if (GET_PREV_FREE(p) != 1 || GET_FREE(p) != 0) return 8 + i*10;  // Flags mixed up
+    SET_FREE(p, 1);
+    SET_NEXT(p, addr[i]);
+    if (GET_NEXT(p) != addr[i] || GET_PREV_FREE(p) != 1) return 9 + i*10;  // Next pointer or flag damaged
+    SET_PREV_FREE(p, 0);
+    SET_FREE(p, 0);
+    if (GET_PREV_FREE(p) != 0 || GET_NEXT(p) != addr[i]) return 9 + i*10;  // Flag not cleared
+
     /* Check size with and without flag */
     SET_FREE(p,i);
 
@@ -49,37 +69,195 @@ int simple_macro_test() {
 } 
 
 
-static void print_block(BlockHeader * p) {
-  printf("Block at 0x%08lx next = 0x%08lx, free = %d\n",  (uintptr_t) p, (uintptr_t) GET_NEXT(p), GET_FREE(p));
+/**
+ * @name    simple_search_visits
+ * @brief   Number of free blocks visited by simple_malloc searches so far
+ */
+size_t simple_search_visits(void) {
+  int n = atomic_load_explicit(&arena_count, memory_order_acquire);
+  size_t visits;
+  int i;
+
+  pthread_mutex_lock(&main_heap.lock);
+  visits = main_heap.search_visits;
+  pthread_mutex_unlock(&main_heap.lock);
+
+  for (i = 0; i < n; i++) {
+    pthread_mutex_lock(&arenas[i].lock);
+    visits += arenas[i].search_visits;
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+  return visits;
 }
 
 
+#ifndef MM_BITMAP
+
 /**
- * @name    simple_block_dump
- * @brief   Dumps the current list of blocks on standard out
+ * @name    largest_free
+ * @brief   Size of the largest free block of h, header included
+ *
+ * Bins are ordered by size, so only the highest non-empty bin is searched.
+ * Must be called with h->lock held.
  */
-void simple_block_dump(void) {
+static size_t largest_free(Heap * h) {
+  BlockHeader * p;
+  size_t largest = 0;
+  int i;
+
+  for (i = NUM_BINS - 1; i >= 0 && h->bins[i] == NULL; i--) {
+  }
+  if (i >= 0) {
+    for (p = h->bins[i]; p != NULL; p = LINKS(p)->next) {
+      if (SIZE(p) + sizeof(BlockHeader) > largest) {
+        largest = SIZE(p) + sizeof(BlockHeader);
+      }
+    }
+  }
+  return largest;
+}
+
+#endif
+
+
+/**
+ * @name    heap_info
+ * @brief   Add the free block counts and search histogram of h to info
+ */
+static void heap_info(Heap * h, MallocInfo * info) {
+  size_t largest;
+  int i;
+
+  pthread_mutex_lock(&h->lock);
+  info->free += h->free_bytes;
+  info->free_blocks += h->free_blocks;
+  largest = largest_free(h);
+  if (largest > info->largest_free) {
+    info->largest_free = largest;
+  }
+  for (i = 0; i < MALLOC_SEARCH_BUCKETS; i++) {
+    info->search_histogram[i] += h->search_hist[i];
+  }
+  pthread_mutex_unlock(&h->lock);
+}
+
+
+/**
+ * @name    simple_mallinfo
+ * @brief   Collect heap statistics from counters kept up to date by the allocator
+ *
+ * Apart from largest_free the cost does not depend on the number of blocks,
+ * only on the number of arenas and threads. largest_free is not counted but
+ * looked up in every heap: a walk of its highest non-empty bin, or with
+ * ENGINE=bitmap of its highest non-empty class, see largest_free. The
+ * counts of the different heaps and threads are taken one after the other,
+ * so they may be slightly out of step while other threads allocate.
+ */
+MallocInfo simple_mallinfo(void) {
+  int n = atomic_load_explicit(&arena_count, memory_order_acquire);
+  MallocInfo info = { 0 };
+  ThreadCache * tc;
+  int i;
+
+  heap_info(&main_heap, &info);
+  for (i = 0; i < n; i++) {
+    heap_info(&arenas[i], &info);
+  }
+  info.in_use = atomic_load_explicit(&stats_in_use, memory_order_relaxed);
+  info.peak_in_use = atomic_load_explicit(&stats_peak, memory_order_relaxed);
+  info.footprint = (memory_end - memory_start) + atomic_load_explicit(&stats_mapped, memory_order_relaxed);
+  info.released = atomic_load_explicit(&stats_released, memory_order_relaxed);
+  if (info.free > 0) {
+    info.fragmentation = 1.0 - (double) info.largest_free / info.free;
+  }
+
+  pthread_mutex_lock(&stats_lock);
+  info.mallocs = retired.mallocs;
+  info.frees = retired.frees;
+  info.failed = retired.failed;
+  for (tc = caches; tc != NULL; tc = tc->next) {
+    info.mallocs += atomic_load_explicit(&tc->mallocs, memory_order_relaxed);
+    info.frees += atomic_load_explicit(&tc->frees, memory_order_relaxed);
+    info.failed += atomic_load_explicit(&tc->failed, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&stats_lock);
+  return info;
+}
+
+
+static void print_block(BlockHeader * p) {
+  printf("Block at 0x%08lx next = 0x%08lx, free = %d, prev free = %d\n",  (uintptr_t) p, (uintptr_t) GET_NEXT(p), GET_FREE(p), GET_PREV_FREE(p));
+}
+
+
+static void block_dump(Heap * h) {
   BlockHeader * p;
 
-  if (first == NULL) {
+  if (h->first == NULL) {
     printf("Data structure is not initialized\n");
     return;
   }
 
-  printf("first = 0x%08lx, current = 0x%08lx\n", (uintptr_t) first, (uintptr_t) current);
+  printf("first = 0x%08lx\n", (uintptr_t) h->first);
 
-  p = first;
+  p = h->first;
 
   do {
-    if ((uintptr_t) p < memory_start || (uintptr_t) p >= memory_end) {
+    if ((uintptr_t) p < h->start || (uintptr_t) p >= h->end) {
       printf("Block pointer 0x%08lx out of range\n", (uintptr_t) p);
       return;
     }
 
     print_block(p);
+#ifdef MM_BITMAP
+    if (!bitmap_agrees(h, p)) {
+      printf("Free bitmaps out of step with the block\n");
+    }
+#endif
 
     p = GET_NEXT(p);
-  } while (p != first);
+  } while (p != h->first);
+
+}
+
+
+/**
+ * @name    simple_block_dump
+ * @brief   Dumps the current list of blocks on standard out
+ *
+ * The main heap is dumped first, followed by each arena. An arena shows up
+ * as one allocated block in the main heap. Blocks held in thread caches or
+ * waiting on a remote free stack are shown as allocated.
+ */
+void simple_block_dump(void) {
+  int n = atomic_load_explicit(&arena_count, memory_order_acquire);
+  int i;
 
+  pthread_mutex_lock(&main_heap.lock);
+  block_dump(&main_heap);
+  pthread_mutex_unlock(&main_heap.lock);
+
+  for (i = 0; i < n; i++) {
+    printf("Arena %d:\n", i);
+    pthread_mutex_lock(&arenas[i].lock);
+    block_dump(&arenas[i]);
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
 }
 
+
+/**
+ * @name    simple_heap_dump
+ * @brief   Dumps the list of blocks of heap on standard out
+ *
+ * For the default heap this is simple_block_dump.
+ */
+void simple_heap_dump(Heap * heap) {
+  if (heap == &main_heap) {
+    simple_block_dump();
+    return;
+  }
+  pthread_mutex_lock(&heap->lock);
+  block_dump(heap);
+  pthread_mutex_unlock(&heap->lock);
+}
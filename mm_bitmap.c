@@ -0,0 +1,389 @@
+/* Free-space bitmap engine to be included by mm.c when built with ENGINE=bitmap */
+
+
+/*
+ * Free-space bitmaps
+ *
+ * Instead of free lists threaded through the blocks, each heap describes its
+ * free blocks in bitmaps kept apart from the heap, with one bit per 8-byte
+ * granule counted from the heap's first block. free_start has the bit of the
+ * first granule of every free block set, free_end that of its last granule.
+ * Free blocks are always coalesced, so the first end bit at or after the
+ * start of a free block is its own.
+ *
+ * Free blocks are sorted into the size classes (fl, sl) of the tlsf engine,
+ * see mm_tlsf.c, with fl_bitmap and sl_bitmap telling which classes hold a
+ * block. Each class has an index over the words of free_start: a tree of
+ * bitmaps whose lowest level has a bit per word, set when the word holds the
+ * start of a block of the class, and each level above a bit per word of the
+ * one below, set when that word is not zero, up to a single word. A search
+ * rounds the size up to the next class boundary, finds the first non-empty
+ * class from there with two find-first-set operations, and follows the
+ * lowest bits down that class's index to a word of free_start. Its cost
+ * depends on the height of the index, not on the number of free blocks.
+ *
+ * A search reads only the bitmaps: no header or user memory is touched until
+ * the block is chosen. Pushing a block sets its start and end bits, and the
+ * bits of its class's index up to the first word that was not zero. Removing
+ * one clears its start and end bits, and its class's bit in the lowest level
+ * unless another block of the class starts in the same word, which it tells
+ * from the headers of the free blocks there. The levels above are cleared
+ * lazily, by the searches that find a bit there over a word that is zero,
+ * so a block that keeps moving between classes does not walk up the index.
+ * class_words counts the words indexed for each class, to tell when the
+ * class is empty.
+ */
+#define WORD_BITS      (64)
+#define GRANULE(h,p)   (((uintptr_t) (p) - (uintptr_t) (h)->first) / 8)   /* Granule of p in h */
+#define NO_GRANULE     (~(size_t) 0)
+
+
+/**
+ * @name    bin_mapping
+ * @brief   Find the class (fl, sl) holding blocks with size bytes available for the user
+ */
+static inline void bin_mapping(size_t size, int * fl, int * sl) {
+    *fl = 63 - __builtin_clzl(size);
+    *sl = (int) (size >> (*fl - SL_LOG)) - SL_COUNT;
+}
+
+
+/**
+ * @name    bin_fit_size
+ * @brief   Round size up to the next class boundary
+ *
+ * Every block in the class of the rounded size has at least size bytes.
+ */
+static inline size_t bin_fit_size(size_t size) {
+    size_t step = (size_t) 1 << (63 - __builtin_clzl(size) - SL_LOG);
+    return (size + step - 1) & ~(step - 1);
+}
+
+
+/**
+ * @name    bitmap_init
+ * @brief   Map the bitmaps of h for blocks from its first block up to limit
+ * @retval  1 if done, 0 if not possible
+ */
+static int bitmap_init(Heap * h, uintptr_t limit) {
+    size_t words = (GRANULE(h, limit) + WORD_BITS) / WORD_BITS;
+    size_t level_words = (words + WORD_BITS - 1) / WORD_BITS;
+    size_t mapped;
+    uint64_t * map;
+    int levels = 0;
+
+    if (h->free_end != NULL) {
+        return 1;
+    }
+    /* The levels of one class's index, down to a single word */
+    h->index_level[0] = 0;
+    for (;;) {
+        h->index_level[levels + 1] = h->index_level[levels] + level_words;
+        levels++;
+        if (level_words == 1) {
+            break;
+        }
+        level_words = (level_words + WORD_BITS - 1) / WORD_BITS;
+    }
+    h->index_levels = levels;
+    h->map_words = words;
+
+    /* No block is larger than the heap could grow, which bounds the classes */
+    h->map_classes = (64 - __builtin_clzl(limit - (uintptr_t) h->first)) * SL_COUNT;
+
+    /* Fresh mappings are zero, and only the pages in use get backed */
+    map = (uint64_t *) memory_map((2 * words + h->map_classes * (h->index_level[levels] + 1)) * sizeof(uint64_t),
+                                  &mapped);
+    if (map == NULL) {
+        return 0;
+    }
+    h->free_end = map;
+    h->free_start = map + words;
+    h->class_words = map + 2 * words;
+    h->free_index = h->class_words + h->map_classes;
+    return 1;
+}
+
+
+/**
+ * @name    bitmap_free
+ * @brief   Unmap the bitmaps of h
+ */
+static void bitmap_free(Heap * h) {
+    memory_unmap((uintptr_t) h->free_end,
+                 (2 * h->map_words + h->map_classes * (h->index_level[h->index_levels] + 1)) * sizeof(uint64_t));
+    h->free_end = NULL;
+}
+
+
+/**
+ * @name    block_class
+ * @brief   Index of the class of free block block, fl * SL_COUNT + sl
+ */
+static inline int block_class(BlockHeader * block) {
+    int fl, sl;
+    bin_mapping(SIZE(block), &fl, &sl);
+    return fl * SL_COUNT + sl;
+}
+
+
+/**
+ * @name    index_set
+ * @brief   Record that word w of free_start holds the start of a block of class c
+ */
+static inline void index_set(Heap * h, int c, size_t w) {
+    uint64_t * index = h->free_index + c * h->index_level[h->index_levels];
+    uint64_t * word = index + w / WORD_BITS;
+    uint64_t was = *word;
+    int level;
+
+    if (was & 1UL << (w % WORD_BITS)) {
+        return;
+    }
+    *word = was | 1UL << (w % WORD_BITS);
+    if (h->class_words[c]++ == 0) {
+        h->sl_bitmap[c / SL_COUNT] |= 1U << (c % SL_COUNT);
+        h->fl_bitmap |= 1UL << (c / SL_COUNT);
+    }
+
+    /* A word that was not zero already has its bit in the level above */
+    for (level = 1; level < h->index_levels && was == 0; level++) {
+        w /= WORD_BITS;
+        word = index + h->index_level[level] + w / WORD_BITS;
+        was = *word;
+        *word = was | 1UL << (w % WORD_BITS);
+    }
+}
+
+
+/**
+ * @name    index_clear
+ * @brief   Record that word w of free_start no longer holds the start of a block of class c
+ *
+ * Only the lowest level is cleared, see index_next.
+ */
+static inline void index_clear(Heap * h, int c, size_t w) {
+    h->free_index[c * h->index_level[h->index_levels] + w / WORD_BITS] &= ~(1UL << (w % WORD_BITS));
+    if (--h->class_words[c] == 0) {
+        /* The class is empty now */
+        h->sl_bitmap[c / SL_COUNT] &= ~(1U << (c % SL_COUNT));
+        if (h->sl_bitmap[c / SL_COUNT] == 0) {
+            h->fl_bitmap &= ~(1UL << (c / SL_COUNT));
+        }
+    }
+}
+
+
+/**
+ * @name    index_next
+ * @brief   First word of free_start from word w on that holds the start of a block of class c
+ * @retval  The word, or NO_GRANULE if there is none
+ *
+ * Goes up the index until a word has a bit at or after the position, then
+ * down along the lowest bits. From word 0 it starts at the top right away.
+ * A bit over a word that has become zero is cleared on the way, and the
+ * search starts again.
+ */
+static size_t index_next(Heap * h, int c, size_t w) {
+    uint64_t * index = h->free_index + c * h->index_level[h->index_levels];
+    size_t from = w;
+    uint64_t word;
+    int level;
+
+    for (;;) {
+        for (level = from == 0 ? h->index_levels - 1 : 0, w = from;; level++, w = w / WORD_BITS + 1) {
+            if (level == h->index_levels || w / WORD_BITS >= h->index_level[level + 1] - h->index_level[level]) {
+                return NO_GRANULE;
+            }
+            word = index[h->index_level[level] + w / WORD_BITS] & (~0UL << (w % WORD_BITS));
+            if (word != 0) {
+                break;
+            }
+        }
+        w = (w & ~(size_t) (WORD_BITS - 1)) + __builtin_ctzl(word);
+        for (; level > 0 && (word = index[h->index_level[level - 1] + w]) != 0; level--) {
+            w = w * WORD_BITS + __builtin_ctzl(word);
+        }
+        if (level == 0) {
+            return w;
+        }
+        /* The word below has become zero */
+        index[h->index_level[level] + w / WORD_BITS] &= ~(1UL << (w % WORD_BITS));
+    }
+}
+
+
+/**
+ * @name    bitmap_end
+ * @brief   Last granule of the free block starting at granule g
+ */
+static inline size_t bitmap_end(Heap * h, size_t g) {
+    size_t w = g / WORD_BITS;
+    uint64_t map = h->free_end[w] & (~0UL << (g % WORD_BITS));
+
+    while (map == 0) {
+        map = h->free_end[++w];
+    }
+    return w * WORD_BITS + __builtin_ctzl(map);
+}
+
+
+/**
+ * @name    bitmap_pick
+ * @brief   First free block starting in word w of free_start that spans at least n granules
+ * @retval  Its first granule
+ *
+ * The word holds the start of a block that fits. A block followed by
+ * another start in the word ends before it, so its end bit is found at
+ * once. The last block of the word is taken unchecked, as none before it
+ * was the one that fits.
+ */
+static size_t bitmap_pick(Heap * h, size_t w, size_t n) {
+    uint64_t map = h->free_start[w];
+    size_t g;
+
+    for (;;) {
+        g = w * WORD_BITS + __builtin_ctzl(map);
+        map &= map - 1;
+        h->search_visits++;
+        if (map == 0 || bitmap_end(h, g) - g + 1 >= n) {
+            return g;
+        }
+    }
+}
+
+
+/**
+ * @name    bitmap_mark
+ * @brief   Set (on = 1) or clear (on = 0) the bits of a free block in the bitmaps
+ */
+static inline void bitmap_mark(Heap * h, BlockHeader * block, int on) {
+    size_t g = GRANULE(h, block);
+    size_t e = GRANULE(h, GET_NEXT(block)) - 1;
+    size_t w = g / WORD_BITS;
+    int c = block_class(block);
+    uint64_t map;
+
+    if (on) {
+        h->free_start[w] |= 1UL << (g % WORD_BITS);
+        h->free_end[e / WORD_BITS] |= 1UL << (e % WORD_BITS);
+        index_set(h, c, w);
+        return;
+    }
+    h->free_start[w] &= ~(1UL << (g % WORD_BITS));
+    h->free_end[e / WORD_BITS] &= ~(1UL << (e % WORD_BITS));
+
+    /* The word stays indexed for the class if another block of it starts there */
+    for (map = h->free_start[w]; map != 0; map &= map - 1) {
+        if (block_class((BlockHeader *) ((uintptr_t) h->first + (w * WORD_BITS + __builtin_ctzl(map)) * 8)) == c) {
+            return;
+        }
+    }
+    index_clear(h, c, w);
+}
+
+
+/**
+ * @name    bin_push
+ * @brief   Mark a free block in the bitmaps
+ *
+ * Its header counts as written, as in the other engines. So does the
+ * footer of the block before it, which may be left inside a larger block
+ * when the two merge.
+ */
+static inline void bin_push(Heap * h, BlockHeader * block) {
+    mark_written(h, block->user_block);
+    bitmap_mark(h, block, 1);
+    bin_count(h, block, 1);
+}
+
+
+/**
+ * @name    bin_remove
+ * @brief   Clear a free block in the bitmaps
+ */
+static inline void bin_remove(Heap * h, BlockHeader * block) {
+    bin_count(h, block, -1);
+    bitmap_mark(h, block, 0);
+}
+
+
+/**
+ * @name    bin_search
+ * @brief   Find and unlink a free block with at least size bytes available
+ * @retval  The block or NULL if no class holds a large enough block
+ *
+ * Of the blocks in the first non-empty class that fits, the one lowest in
+ * the heap is taken.
+ */
+static BlockHeader * bin_search(Heap * h, size_t size) {
+    BlockHeader * block;
+    uint32_t sl_map;
+    uint64_t fl_map;
+    int fl, sl;
+
+    bin_mapping(bin_fit_size(size), &fl, &sl);
+
+    /* First a class of the same level, else the smallest class of a higher one */
+    sl_map = h->sl_bitmap[fl] & (~0U << sl);
+    if (sl_map == 0) {
+        fl_map = fl < 63 ? h->fl_bitmap & (~0UL << (fl + 1)) : 0;
+        if (fl_map == 0) {
+            return NULL;
+        }
+        fl = __builtin_ctzl(fl_map);
+        sl_map = h->sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+
+    block = (BlockHeader *) ((uintptr_t) h->first
+                             + bitmap_pick(h, index_next(h, fl * SL_COUNT + sl, 0), (size + sizeof(BlockHeader) + 7) / 8) * 8);
+    bin_remove(h, block);
+    return block;
+}
+
+
+/**
+ * @name    largest_free
+ * @brief   Size of the largest free block of h, header included
+ *
+ * Only the blocks starting in the words indexed for the highest non-empty
+ * class are looked at, through their headers.
+ * Must be called with h->lock held.
+ */
+static size_t largest_free(Heap * h) {
+    size_t largest = 0;
+    uint64_t map;
+    size_t w;
+    int fl, c;
+
+    if (h->first == NULL || h->fl_bitmap == 0) {
+        return 0;
+    }
+    fl = 63 - __builtin_clzl(h->fl_bitmap);
+    c = fl * SL_COUNT + 31 - __builtin_clz(h->sl_bitmap[fl]);
+    for (w = index_next(h, c, 0); w != NO_GRANULE; w = index_next(h, c, w + 1)) {
+        for (map = h->free_start[w]; map != 0; map &= map - 1) {
+            BlockHeader * block = (BlockHeader *) ((uintptr_t) h->first + (w * WORD_BITS + __builtin_ctzl(map)) * 8);
+            if (SIZE(block) + sizeof(BlockHeader) > largest) {
+                largest = SIZE(block) + sizeof(BlockHeader);
+            }
+        }
+    }
+    return largest;
+}
+
+
+/**
+ * @name    bitmap_agrees
+ * @brief   Do the bitmaps describe block as its header does?
+ */
+static int bitmap_agrees(Heap * h, BlockHeader * block) {
+    size_t g = GRANULE(h, block);
+    int start = (h->free_start[g / WORD_BITS] >> (g % WORD_BITS)) & 1;
+
+    if (start != GET_FREE(block)) {
+        return 0;
+    }
+    return !start || bitmap_end(h, g) == GRANULE(h, GET_NEXT(block)) - 1;
+}
@@ -0,0 +1,193 @@
+/* Buddy system engine to be included by mm.c when built with ENGINE=buddy */
+
+
+/*
+ * Buddy system
+ *
+ * Every free block, header included, spans a power of two bytes, 2^k, at an
+ * offset from the heap's first block that is a multiple of 2^k. Its buddy is
+ * the block of the same size found by flipping bit k of the offset. When both
+ * are free they merge into a block of 2^(k+1), so coalescing only ever
+ * checks one neighbour per size and takes constant time. The boundary tags
+ * tell whether the buddy is free and how large it is.
+ *
+ * An allocation takes a block of the smallest size that fits and returns the
+ * upper halves of it to the bins while halving it down. Bin k holds the free
+ * blocks of 2^k bytes, and bin_bitmap has bit k set when bin k is not empty.
+ *
+ * Any range of memory given back, like the gap in front of an aligned block
+ * or a segment added by heap_grow, is cut into the largest blocks its offsets
+ * allow. The heap starts so that user_blocks of blocks of up to a page are
+ * aligned to their size.
+ */
+#define BLOCK_GRAIN    (32)           // Smallest block, all block offsets are multiples of it
+#define BASE_ALIGN     (PAGE_SIZE)
+
+
+/**
+ * @name    buddy_size
+ * @brief   Size of the smallest block, header included, with size bytes available for the user
+ */
+static inline size_t buddy_size(size_t size) {
+    size_t total = size + sizeof(BlockHeader);
+    if (total <= BLOCK_GRAIN) {
+        return BLOCK_GRAIN;
+    }
+    return (size_t) 1 << (64 - __builtin_clzl(total - 1));
+}
+
+
+/**
+ * @name    bin_fit_size
+ * @brief   Size of a free range that is sure to hold a block with size bytes available
+ *
+ * Cutting a range into buddies may leave no block as large as the range
+ * itself, but one of at least half of it.
+ */
+static inline size_t bin_fit_size(size_t size) {
+    return 2 * buddy_size(size);
+}
+
+
+/**
+ * @name    bin_push
+ * @brief   Insert a free block at the head of the bin matching its size
+ */
+static inline void bin_push(Heap * h, BlockHeader * block) {
+    int k = 63 - __builtin_clzl(SIZE(block) + sizeof(BlockHeader));
+    LINKS(block)->next = h->bins[k];
+    LINKS(block)->prev = NULL;
+    if (h->bins[k] != NULL) {
+        LINKS(h->bins[k])->prev = block;
+    }
+    h->bins[k] = block;
+    h->bin_bitmap |= 1UL << k;
+    mark_written(h, LINKS(block) + 1);
+    bin_count(h, block, 1);
+}
+
+
+/**
+ * @name    bin_remove
+ * @brief   Unlink a free block from the bin matching its size
+ */
+static inline void bin_remove(Heap * h, BlockHeader * block) {
+    BlockHeader * next = LINKS(block)->next;
+    BlockHeader * prev = LINKS(block)->prev;
+    int k;
+
+    bin_count(h, block, -1);
+    if (prev != NULL) {
+        LINKS(prev)->next = next;
+    } else {
+        k = 63 - __builtin_clzl(SIZE(block) + sizeof(BlockHeader));
+        h->bins[k] = next;
+        if (next == NULL) {
+            h->bin_bitmap &= ~(1UL << k);
+        }
+    }
+    if (next != NULL) {
+        LINKS(next)->prev = prev;
+    }
+}
+
+
+/**
+ * @name    bin_search
+ * @brief   Find and unlink a free block with at least size bytes available
+ * @retval  The block or NULL if no bin holds a large enough block
+ */
+static BlockHeader * bin_search(Heap * h, size_t size) {
+    int k = 63 - __builtin_clzl(buddy_size(size));
+    uint64_t map = h->bin_bitmap & (~0UL << k);
+    BlockHeader * block;
+
+    if (map == 0) {
+        return NULL;
+    }
+    block = h->bins[__builtin_ctzl(map)];
+    h->search_visits++;
+    bin_remove(h, block);
+    return block;
+}
+
+
+/**
+ * @name    free_block
+ * @brief   Give an allocated block back, cut into buddies merged with their free buddies
+ *
+ * The block may span any range between two multiples of BLOCK_GRAIN.
+ * Must be called with h->lock held.
+ */
+static void free_block(Heap * h, BlockHeader * block) {
+    uintptr_t base = (uintptr_t) h->first;
+    uintptr_t start = (uintptr_t) block;
+    uintptr_t end = (uintptr_t) GET_NEXT(block);
+    uintptr_t lo = start;    /* The range to trim: the one freed and buddies too small to have been trimmed */
+    int prev_free = GET_PREV_FREE(block);
+
+    while (start < end) {
+        /* The largest block the offset of start and the remaining range allow */
+        size_t size = (size_t) 1 << (63 - __builtin_clzl(end - start));
+        if (start != base && (size_t) ((start - base) & -(start - base)) < size) {
+            size = (start - base) & -(start - base);
+        }
+
+        block = (BlockHeader *) start;
+        INIT_NEXT(block, start + size, 0x1 | (prev_free ? 0x2 : 0));
+
+        for (;;) {
+            uintptr_t buddy = base + ((start - base) ^ size);
+            BlockHeader * other = (BlockHeader *) buddy;
+
+            if (buddy < start && GET_PREV_FREE(block) && PREV_BLOCK(block) == other
+                && SIZE(other) + sizeof(BlockHeader) == size) {
+                /* Merge with the buddy below */
+                if (size < TRIM_THRESHOLD && buddy < lo) {
+                    lo = buddy;
+                }
+                bin_remove(h, other);
+                SET_NEXT(other, start + size);
+                block = other;
+                start = buddy;
+            } else if (buddy == end && GET_FREE(other) && SIZE(other) + sizeof(BlockHeader) == size) {
+                /* Merge with the buddy above, which follows the range */
+                bin_remove(h, other);
+                SET_NEXT(block, GET_NEXT(other));
+                end = (uintptr_t) GET_NEXT(other);
+            } else {
+                break;
+            }
+            size *= 2;
+        }
+
+        SET_FOOTER(block);
+        bin_push(h, block);
+        if (size >= TRIM_THRESHOLD) {
+            trim_block(h, block, lo > start + TRIM_PAD ? lo : start + TRIM_PAD, end);
+        }
+        start += size;
+        prev_free = 1;
+    }
+    block = (BlockHeader *) end;
+    SET_PREV_FREE(block, 1);
+}
+
+
+/**
+ * @name    split_block
+ * @brief   Shrink an allocated block to the smallest buddy with size bytes, returning the rest to the bins
+ */
+static void split_block(Heap * h, BlockHeader * block, size_t size) {
+    BlockHeader * next = GET_NEXT(block);
+    BlockHeader * tail = (BlockHeader *) ((uintptr_t) block + buddy_size(size));
+
+    if (tail >= next) {
+        return;
+    }
+
+    // The tail starts out as an allocated block after an allocated one
+    INIT_NEXT(tail, next, 0);
+    SET_NEXT(block, tail);
+    free_block(h, tail);
+}
@@ -0,0 +1,126 @@
+/**
+ * @file   mm_pool.c
+ * @brief  Fixed-size object pools on top of simple_malloc.
+ *
+ * A pool hands out objects of one size from slabs carved out of the heap
+ * with simple_malloc. Objects carry no header of their own: a free object
+ * holds the link to the next free object of the pool, and fresh objects are
+ * taken from the newest slab by bumping a pointer. Both allocation and free
+ * are O(1). Slabs are only returned to the heap when the pool is destroyed.
+ *
+ * A pool must not be used by more than one thread at a time.
+ */
+
+#include <stdint.h>
+
+#include "mm.h"
+
+#define SLAB_SIZE    (4096)   // Bytes requested from simple_malloc per slab
+
+typedef struct slab {
+    struct slab * next;       // Previous slab of the pool
+    uint64_t objects[0];      // Objects start here, 8-byte aligned
+} Slab;
+
+struct pool {
+    size_t size;              // Object size, a multiple of 8 bytes
+    void * free_list;         // Freed objects, linked through their first word
+    Slab * slabs;             // All slabs, newest first
+    char * bump;              // Next never-used object in the newest slab
+    char * bump_end;          // End of the newest slab
+};
+
+
+/**
+ * @name    simple_pool_create
+ * @brief   Create a pool of objects of size bytes each
+ * @retval  The pool or NULL if not possible
+ */
+Pool * simple_pool_create(size_t size) {
+    Pool * pool;
+
+    /* Objects must hold the free list link and stay 8-byte aligned */
+    if (size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+    size = (size + 0x7) & ~0x7;
+    if (size > SLAB_SIZE - sizeof(Slab)) {
+        return NULL;
+    }
+
+    pool = simple_malloc(sizeof(Pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->size = size;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->bump = NULL;
+    pool->bump_end = NULL;
+    return pool;
+}
+
+
+/**
+ * @name    simple_pool_alloc
+ * @brief   Allocate one object from a pool
+ * @retval  Pointer to the object or NULL if not possible
+ */
+void * simple_pool_alloc(Pool * pool) {
+    void * obj = pool->free_list;
+
+    /* Reuse a freed object */
+    if (obj != NULL) {
+        pool->free_list = *(void **) obj;
+        return obj;
+    }
+
+    /* Start a new slab when the newest one is used up */
+    if (pool->bump == NULL || pool->bump + pool->size > pool->bump_end) {
+        Slab * slab = simple_malloc(SLAB_SIZE);
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->bump = (char *) slab->objects;
+        pool->bump_end = (char *) slab + SLAB_SIZE;
+    }
+
+    obj = pool->bump;
+    pool->bump += pool->size;
+    return obj;
+}
+
+
+/**
+ * @name    simple_pool_free
+ * @brief   Return an object to the pool it was allocated from
+ */
+void simple_pool_free(Pool * pool, void * ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    *(void **) ptr = pool->free_list;
+    pool->free_list = ptr;
+}
+
+
+/**
+ * @name    simple_pool_destroy
+ * @brief   Release a pool and all of its slabs, including objects still allocated
+ */
+void simple_pool_destroy(Pool * pool) {
+    Slab * slab;
+
+    if (pool == NULL) {
+        return;
+    }
+    slab = pool->slabs;
+    while (slab != NULL) {
+        Slab * next = slab->next;
+        simple_free(slab);
+        slab = next;
+    }
+    simple_free(pool);
+}
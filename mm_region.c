@@ -0,0 +1,127 @@
+/**
+ * @file   mm_region.c
+ * @brief  Bump-pointer regions on top of simple_malloc.
+ *
+ * A region hands out memory for objects that share one lifetime. Memory is
+ * taken from chunks obtained with simple_malloc by bumping a pointer, and is
+ * never freed object by object. Instead a mark records the current position,
+ * and resetting to the mark releases everything allocated since in one go.
+ * Destroying the region releases all of it.
+ *
+ * A region must not be used by more than one thread at a time.
+ */
+
+#include <stdint.h>
+
+#include "mm.h"
+
+#define CHUNK_SIZE   (64*1024)   // Bytes requested from simple_malloc per chunk
+
+typedef struct chunk {
+    struct chunk * next;      // Previous chunk of the region
+    char * end;               // End of the chunk
+    uint64_t data[0];         // Allocations start here, 8-byte aligned
+} Chunk;
+
+struct region {
+    Chunk * chunks;           // All chunks, newest first
+    char * bump;              // Next free byte in the newest chunk
+    char * end;               // End of the newest chunk
+};
+
+
+/**
+ * @name    simple_region_create
+ * @brief   Create an empty region
+ * @retval  The region or NULL if not possible
+ */
+Region * simple_region_create(void) {
+    Region * region = simple_malloc(sizeof(Region));
+    if (region == NULL) {
+        return NULL;
+    }
+    region->chunks = NULL;
+    region->bump = NULL;
+    region->end = NULL;
+    return region;
+}
+
+
+/**
+ * @name    simple_region_alloc
+ * @brief   Allocate size bytes from a region
+ *
+ * Requests larger than a chunk get a chunk of their own.
+ *
+ * @retval  Pointer to 8-byte aligned memory or NULL if not possible
+ */
+void * simple_region_alloc(Region * region, size_t size) {
+    void * ptr;
+
+    size = (size + 0x7) & ~0x7;
+    if (size > (size_t) (region->end - region->bump)) {
+        size_t chunk_size = sizeof(Chunk) + size > CHUNK_SIZE ? sizeof(Chunk) + size : CHUNK_SIZE;
+        Chunk * chunk = simple_malloc(chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = region->chunks;
+        chunk->end = (char *) chunk + chunk_size;
+        region->chunks = chunk;
+        region->bump = (char *) chunk->data;
+        region->end = chunk->end;
+    }
+
+    ptr = region->bump;
+    region->bump += size;
+    return ptr;
+}
+
+
+/**
+ * @name    simple_region_mark
+ * @brief   Record the current position of a region
+ */
+RegionMark simple_region_mark(Region * region) {
+    RegionMark mark = { region->chunks, region->bump };
+    return mark;
+}
+
+
+/**
+ * @name    simple_region_reset
+ * @brief   Release everything allocated from a region since mark was taken
+ *
+ * Chunks started after the mark are returned to the heap, so the cost
+ * depends on the number of chunks, not on the number of allocations.
+ */
+void simple_region_reset(Region * region, RegionMark mark) {
+    while (region->chunks != mark.chunk) {
+        Chunk * next = region->chunks->next;
+        simple_free(region->chunks);
+        region->chunks = next;
+    }
+
+    if (mark.chunk == NULL) {
+        region->bump = NULL;
+        region->end = NULL;
+    } else {
+        region->bump = mark.bump;
+        region->end = ((Chunk *) mark.chunk)->end;
+    }
+}
+
+
+/**
+ * @name    simple_region_destroy
+ * @brief   Release a region and everything allocated from it
+ */
+void simple_region_destroy(Region * region) {
+    RegionMark empty = { NULL, NULL };
+
+    if (region == NULL) {
+        return;
+    }
+    simple_region_reset(region, empty);
+    simple_free(region);
+}
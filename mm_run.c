@@ -0,0 +1,200 @@
+/* Runs of header-free small objects, to be included in mm.c after free_block */
+
+
+/**
+ * @name    run_size
+ * @brief   Object size of the class serving a request of size bytes, at most RUN_MAX_SIZE
+ *
+ * Above 8 bytes the classes are multiples of 16, so objects are 16-byte aligned.
+ * With MM_ALIGN 16 all of them are.
+ */
+static inline size_t run_size(size_t size) {
+    if (size <= 8 && MM_ALIGN == 8) {
+        return 8;
+    }
+    return size <= 16 ? 16 : (size + 15) & ~(size_t) 15;
+}
+
+
+/**
+ * @name    run_of
+ * @brief   Find the run holding the object at ptr
+ * @retval  The run's descriptor, or NULL if ptr is not in a run
+ *
+ * ptr must lie in the heap's range or in a mapping of ours, see simple_owns.
+ */
+static inline Run * run_of(void * ptr) {
+    uintptr_t p = (uintptr_t) ptr;
+    Run * run;
+
+    if (run_table == NULL || p < memory_start || p >= memory_limit) {
+        return NULL;
+    }
+    run = &run_table[(p - memory_start) / PAGE_SIZE];
+    return run->heap != NULL ? run : NULL;
+}
+
+
+/**
+ * @name    run_start
+ * @brief   Address of the first object of a run, the start of its page
+ */
+static inline uintptr_t run_start(Run * run) {
+    return memory_start + (uintptr_t) (run - run_table) * PAGE_SIZE;
+}
+
+
+/**
+ * @name    run_used
+ * @brief   Is the object at ptr allocated from its run? Objects in thread caches are.
+ *
+ * Only the object's own bit is of interest, which changes under the heap's
+ * lock only when the object is handed out or given back, so no lock is taken.
+ */
+static inline int run_used(Run * run, void * ptr) {
+    size_t index = ((uintptr_t) ptr - run_start(run)) / run->size;
+    return (__atomic_load_n(&run->used[index / 64], __ATOMIC_RELAXED) >> (index % 64)) & 1;
+}
+
+
+/**
+ * @name    run_push
+ * @brief   Put a run at the head of the runs with free objects of its class in h
+ */
+static inline void run_push(Heap * h, Run * run) {
+    Run ** head = &h->runs[run->size / 8 - 1];
+
+    run->next = *head;
+    run->prev = NULL;
+    if (*head != NULL) {
+        (*head)->prev = run;
+    }
+    *head = run;
+}
+
+
+/**
+ * @name    run_unlink
+ * @brief   Take a run out of the runs with free objects of its class in h
+ */
+static inline void run_unlink(Heap * h, Run * run) {
+    if (run->prev != NULL) {
+        run->prev->next = run->next;
+    } else {
+        h->runs[run->size / 8 - 1] = run->next;
+    }
+    if (run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+    run->next = run->prev = NULL;
+}
+
+
+/**
+ * @name    run_create
+ * @brief   Carve a new run for objects of size bytes out of h
+ *
+ * The run is a block whose user_block starts on a page and ends just before
+ * the next page, so the page holds no other user_block. Its descriptor marks
+ * the bits past the last object as used, so searches never hand them out.
+ * Must be called with h->lock held.
+ *
+ * @retval  The run, in the runs of its class, or NULL if not possible
+ */
+static Run * run_create(Heap * h, size_t size) {
+    BlockHeader * block = alloc_block(h, RUN_BYTES, PAGE_SIZE, NULL);
+    Run * run;
+    size_t i;
+
+    if (block == NULL) {
+        return NULL;
+    }
+    if (run_table == NULL) {
+        free_block(h, block);
+        return NULL;
+    }
+    /* The user may write anywhere in the block */
+    mark_written(h, GET_NEXT(block));
+
+    run = &run_table[((uintptr_t) block->user_block - memory_start) / PAGE_SIZE];
+    run->heap = h;
+    run->size = size;
+    run->capacity = RUN_BYTES / size;
+    run->count = 0;
+    for (i = 0; i < RUN_WORDS; i++) {
+        run->used[i] = 0;
+    }
+    for (i = run->capacity; i < RUN_WORDS * 64; i++) {
+        run->used[i / 64] |= 1UL << (i % 64);
+    }
+    run_push(h, run);
+    return run;
+}
+
+
+/**
+ * @name    run_alloc
+ * @brief   Allocate up to n objects for requests of size bytes from the runs of h
+ *
+ * Free objects are found a bitmap word at a time. A new run is carved when
+ * the class has no run with free objects, and a full run leaves the list.
+ * Must be called with h->lock held.
+ *
+ * @retval  Number of objects allocated, stored in out
+ */
+static size_t run_alloc(Heap * h, size_t size, size_t n, void ** out) {
+    size_t done = 0;
+
+    size = run_size(size);
+    while (done < n) {
+        Run * run = h->runs[size / 8 - 1];
+        uintptr_t start;
+        size_t i;
+
+        if (run == NULL && (run = run_create(h, size)) == NULL) {
+            break;
+        }
+        start = run_start(run);
+        for (i = 0; i < RUN_WORDS && done < n; i++) {
+            while (~run->used[i] != 0 && done < n) {
+                int bit = __builtin_ctzl(~run->used[i]);
+                run->used[i] |= 1UL << bit;
+                run->count++;
+                out[done++] = (void *) (start + (i * 64 + bit) * size);
+            }
+        }
+        if (run->count == run->capacity) {
+            run_unlink(h, run);
+        }
+    }
+    return done;
+}
+
+
+/**
+ * @name    run_free
+ * @brief   Give an object back to its run in h
+ *
+ * A run that becomes empty is returned to the heap, unless it is the only
+ * run of its class with free objects, which is kept to avoid carving a new
+ * one for the next request. An object that is not allocated is left alone.
+ * Must be called with h->lock held.
+ */
+static void run_free(Heap * h, Run * run, void * ptr) {
+    size_t index = ((uintptr_t) ptr - run_start(run)) / run->size;
+
+    if (!run_used(run, ptr)) {
+        /* Freed twice */
+        return;
+    }
+    run->used[index / 64] &= ~(1UL << (index % 64));
+    if (run->count-- == run->capacity) {
+        run_push(h, run);
+    }
+    if (run->count == 0 && (run->next != NULL || run->prev != NULL)) {
+        BlockHeader * block = (BlockHeader *) run_start(run) - 1;
+        run_unlink(h, run);
+        run->heap = NULL;
+        free_block(h, block);
+    }
+}
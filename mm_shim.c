@@ -0,0 +1,128 @@
+/**
+ * @file   mm_shim.c
+ * @brief  The standard malloc family on top of the simple allocator, for LD_PRELOAD.
+ *
+ * Built into libsimplemalloc.so by make shim, this runs unmodified programs
+ * on the simple allocator:
+ *
+ *   LD_PRELOAD=./libsimplemalloc.so program
+ *
+ * Pointers the simple allocator does not own (see simple_owns), like memory
+ * allocated before the library took over, go to the C library's allocator
+ * through its __libc_ entry points. These need no dlsym, which may allocate
+ * itself, so the shim is safe from the first call on. The simple allocator
+ * sets itself up on the first allocation with nothing but mmap and pthread
+ * primitives, and the library is built with initial-exec TLS, so a thread's
+ * first allocation does not allocate either. It is also built with MM_ALIGN
+ * 16, so every block is aligned for max_align_t as the C library's are.
+ */
+
+#define _GNU_SOURCE   /* RTLD_NEXT */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mm.h"
+
+extern void * __libc_realloc(void * ptr, size_t size);
+extern void __libc_free(void * ptr);
+
+#define PAGE_SIZE   (4096)
+
+/**
+ * @name    allocated
+ * @brief   Set errno as the C library does when an allocation fails
+ */
+static inline void * allocated(void * ptr) {
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void * malloc(size_t size) {
+    return allocated(simple_malloc(size));
+}
+
+void free(void * ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (simple_owns(ptr)) {
+        simple_free(ptr);
+    } else {
+        __libc_free(ptr);
+    }
+}
+
+void * calloc(size_t nmemb, size_t size) {
+    return allocated(simple_calloc(nmemb, size));
+}
+
+void * realloc(void * ptr, size_t size) {
+    if (ptr != NULL && !simple_owns(ptr)) {
+        return __libc_realloc(ptr, size);
+    }
+    if (ptr != NULL && size == 0) {
+        /* Frees the block, which is no failure */
+        simple_free(ptr);
+        return NULL;
+    }
+    return allocated(simple_realloc(ptr, size));
+}
+
+void * memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return allocated(simple_memalign(alignment, size));
+}
+
+void * aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void ** memptr, size_t alignment, size_t size) {
+    void * ptr;
+
+    if (alignment == 0 || alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    ptr = simple_memalign(alignment, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void * valloc(size_t size) {
+    return memalign(PAGE_SIZE, size);
+}
+
+void * pvalloc(size_t size) {
+    return memalign(PAGE_SIZE, (size + PAGE_SIZE - 1) & ~(size_t) (PAGE_SIZE - 1));
+}
+
+int malloc_trim(size_t pad) {
+    return simple_trim() > 0;
+}
+
+size_t malloc_usable_size(void * ptr) {
+    static size_t (* libc_usable_size)(void *) = NULL;
+
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (simple_owns(ptr)) {
+        return simple_usable_size(ptr);
+    }
+    /* Only needed for memory from before the shim took over, long after startup */
+    if (libc_usable_size == NULL) {
+        libc_usable_size = (size_t (*)(void *)) dlsym(RTLD_NEXT, "malloc_usable_size");
+    }
+    return libc_usable_size != NULL ? libc_usable_size(ptr) : 0;
+}
@@ -0,0 +1,120 @@
+/* Two-level segregated fit engine to be included by mm.c when built with ENGINE=tlsf */
+
+
+/*
+ * Two-level segregated fit (TLSF)
+ *
+ * The first level splits sizes into powers of two, [2^fl, 2^(fl+1)), and the
+ * second level splits each of those into SL_COUNT equal ranges. Each of the
+ * resulting classes has a free list like a bin of the segregated engine.
+ *
+ * fl_bitmap has bit fl set when some class of level fl holds a free block,
+ * and sl_bitmap[fl] has bit sl set when class (fl, sl) does. A search rounds
+ * the size up to the next class boundary, so that any block in that class or
+ * above fits, and finds the first non-empty one with two find-first-set
+ * operations. Searching, pushing and unlinking all take constant time.
+ */
+
+/**
+ * @name    bin_mapping
+ * @brief   Find the class (fl, sl) holding blocks with size bytes available for the user
+ */
+static inline void bin_mapping(size_t size, int * fl, int * sl) {
+    *fl = 63 - __builtin_clzl(size);
+    *sl = (int) (size >> (*fl - SL_LOG)) - SL_COUNT;
+}
+
+
+/**
+ * @name    bin_fit_size
+ * @brief   Round size up to the next class boundary
+ *
+ * Every block in the class of the rounded size has at least size bytes.
+ */
+static inline size_t bin_fit_size(size_t size) {
+    size_t step = (size_t) 1 << (63 - __builtin_clzl(size) - SL_LOG);
+    return (size + step - 1) & ~(step - 1);
+}
+
+
+/**
+ * @name    bin_push
+ * @brief   Insert a free block at the head of the class matching its size
+ */
+static inline void bin_push(Heap * h, BlockHeader * block) {
+    int fl, sl, i;
+    bin_mapping(SIZE(block), &fl, &sl);
+    i = fl * SL_COUNT + sl;
+
+    LINKS(block)->next = h->bins[i];
+    LINKS(block)->prev = NULL;
+    if (h->bins[i] != NULL) {
+        LINKS(h->bins[i])->prev = block;
+    }
+    h->bins[i] = block;
+    h->fl_bitmap |= 1UL << fl;
+    h->sl_bitmap[fl] |= 1U << sl;
+    mark_written(h, LINKS(block) + 1);
+    bin_count(h, block, 1);
+}
+
+
+/**
+ * @name    bin_remove
+ * @brief   Unlink a free block from the class matching its size
+ */
+static inline void bin_remove(Heap * h, BlockHeader * block) {
+    BlockHeader * next = LINKS(block)->next;
+    BlockHeader * prev = LINKS(block)->prev;
+    int fl, sl;
+
+    bin_count(h, block, -1);
+    if (prev != NULL) {
+        LINKS(prev)->next = next;
+    } else {
+        bin_mapping(SIZE(block), &fl, &sl);
+        h->bins[fl * SL_COUNT + sl] = next;
+        if (next == NULL) {
+            /* The class is empty now */
+            h->sl_bitmap[fl] &= ~(1U << sl);
+            if (h->sl_bitmap[fl] == 0) {
+                h->fl_bitmap &= ~(1UL << fl);
+            }
+        }
+    }
+    if (next != NULL) {
+        LINKS(next)->prev = prev;
+    }
+}
+
+
+/**
+ * @name    bin_search
+ * @brief   Find and unlink a free block with at least size bytes available
+ * @retval  The block or NULL if no class holds a large enough block
+ */
+static BlockHeader * bin_search(Heap * h, size_t size) {
+    BlockHeader * block;
+    uint32_t sl_map;
+    uint64_t fl_map;
+    int fl, sl;
+
+    bin_mapping(bin_fit_size(size), &fl, &sl);
+
+    /* First a class of the same level, else the smallest class of a higher one */
+    sl_map = h->sl_bitmap[fl] & (~0U << sl);
+    if (sl_map == 0) {
+        fl_map = fl < 63 ? h->fl_bitmap & (~0UL << (fl + 1)) : 0;
+        if (fl_map == 0) {
+            return NULL;
+        }
+        fl = __builtin_ctzl(fl_map);
+        sl_map = h->sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+
+    block = h->bins[fl * SL_COUNT + sl];
+    h->search_visits++;
+    bin_remove(h, block);
+    return block;
+}
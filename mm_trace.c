@@ -0,0 +1,354 @@
+/* Call tracing to be included at the end of mm.c when built with TRACE=1 */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+/*
+ * Tracing
+ *
+ * Every call of the allocator functions appends a TraceRecord to a buffer of
+ * the calling thread. A buffer is made of TRACE_CHUNKS chunks that are filled
+ * in turn. A full chunk is handed to the writer thread, which appends it to
+ * the trace file while the calling thread goes on with the next chunk. A
+ * thread only waits when the writer is a whole buffer behind.
+ *
+ * The functions above are compiled under untraced names, and the functions
+ * below wrap them, so calls made by the allocator itself, like simple_realloc
+ * moving a block, are not traced. Buffers come straight from memory_map, and
+ * a thread does not trace calls made while it sets up its buffer.
+ *
+ * The file is named by the MM_TRACE_FILE environment variable, mm_trace.bin
+ * by default. trace_decode turns it into CSV.
+ */
+#define TRACE_CHUNK   (4096)   // Records per chunk, written to the file at once
+#define TRACE_CHUNKS  (4)      // Chunks per thread buffer
+
+typedef struct trace_buffer {
+    TraceRecord records[TRACE_CHUNKS][TRACE_CHUNK];
+    atomic_int full[TRACE_CHUNKS];      // Records in a chunk waiting for the writer, 0 when it is free
+    int chunk;                          // Chunk being filled by the owning thread
+    int used;                           // Records in it
+    int written;                        // Next chunk for the writer, so chunks reach the file in order
+    uint16_t id;                        // Thread number in the records
+    atomic_int retired;                 // The thread has exited, the buffer may be reused
+    struct trace_buffer * next;
+} TraceBuffer;
+
+static TraceBuffer * trace_buffers = NULL;   // All buffers, guarded by trace_lock
+static int trace_fd = -1;
+static int trace_threads = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_work = PTHREAD_COND_INITIALIZER;    // A chunk is full
+static pthread_cond_t trace_space = PTHREAD_COND_INITIALIZER;   // A chunk was written
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local TraceBuffer * trace_buffer = NULL;
+static _Thread_local int trace_busy = 0;   // Setting up the buffer, do not trace
+
+
+/**
+ * @name    trace_clock
+ * @brief   Time stamp counter, or nanoseconds where there is none
+ */
+static inline uint64_t trace_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return t.tv_sec * 1000000000UL + t.tv_nsec;
+#endif
+}
+
+
+/**
+ * @name    trace_drain
+ * @brief   Write the full chunks of all buffers to the file, in order per buffer
+ * @retval  Number of chunks written
+ *
+ * Must be called with trace_lock held, which is released while writing.
+ */
+static int trace_drain(void) {
+    TraceBuffer * b;
+    int written = 0;
+
+    for (b = trace_buffers; b != NULL; b = b->next) {
+        int n;
+        while ((n = atomic_load_explicit(&b->full[b->written], memory_order_acquire)) > 0) {
+            pthread_mutex_unlock(&trace_lock);
+            if (write(trace_fd, b->records[b->written], n * sizeof(TraceRecord)) < 0) {
+                /* Nothing to be done, the records are lost */
+            }
+            pthread_mutex_lock(&trace_lock);
+            atomic_store_explicit(&b->full[b->written], 0, memory_order_release);
+            b->written = (b->written + 1) % TRACE_CHUNKS;
+            written++;
+        }
+    }
+    if (written > 0) {
+        pthread_cond_broadcast(&trace_space);
+    }
+    return written;
+}
+
+
+/**
+ * @name    trace_writer
+ * @brief   Background thread appending full chunks to the trace file
+ */
+static void * trace_writer(void * arg) {
+    pthread_mutex_lock(&trace_lock);
+    for (;;) {
+        if (trace_drain() == 0) {
+            pthread_cond_wait(&trace_work, &trace_lock);
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @name    trace_start
+ * @brief   Open the trace file and start the writer thread
+ *
+ * Tracing stays off if the file cannot be created.
+ */
+static void trace_start(void) {
+    const char * name = getenv("MM_TRACE_FILE");
+    TraceFileHeader header = { TRACE_MAGIC, sizeof(TraceRecord), 0 };
+    pthread_t writer;
+
+    trace_fd = open(name != NULL ? name : "mm_trace.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0) {
+        return;
+    }
+    if (write(trace_fd, &header, sizeof(header)) != sizeof(header)
+        || pthread_create(&writer, NULL, trace_writer, NULL) != 0) {
+        close(trace_fd);
+        trace_fd = -1;
+        return;
+    }
+    pthread_detach(writer);
+    atexit(simple_trace_flush);
+}
+
+
+/**
+ * @name    trace_attach
+ * @brief   Give the calling thread a buffer, reusing one of an exited thread if possible
+ * @retval  The buffer or NULL if tracing is off
+ */
+static TraceBuffer * trace_attach(void) {
+    TraceBuffer * b;
+    size_t mapped;
+    int i;
+
+    trace_busy = 1;
+    pthread_once(&trace_once, trace_start);
+    if (trace_fd < 0) {
+        trace_busy = 0;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    for (b = trace_buffers; b != NULL; b = b->next) {
+        if (atomic_load(&b->retired)) {
+            for (i = 0; i < TRACE_CHUNKS && atomic_load(&b->full[i]) == 0; i++) {
+            }
+            if (i == TRACE_CHUNKS) {
+                /* All its records are in the file */
+                atomic_store(&b->retired, 0);
+                break;
+            }
+        }
+    }
+    if (b == NULL && (b = (TraceBuffer *) memory_map(sizeof(TraceBuffer), &mapped)) != NULL) {
+        /* A new mapping is all zero */
+        b->id = trace_threads++;
+        b->next = trace_buffers;
+        trace_buffers = b;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    trace_buffer = b;
+    trace_busy = 0;
+    return b;
+}
+
+
+/**
+ * @name    trace_hand_over
+ * @brief   Hand the chunk being filled to the writer and move on to the next one
+ */
+static void trace_hand_over(TraceBuffer * b) {
+    pthread_mutex_lock(&trace_lock);
+    atomic_store_explicit(&b->full[b->chunk], b->used, memory_order_release);
+    pthread_cond_signal(&trace_work);
+
+    b->chunk = (b->chunk + 1) % TRACE_CHUNKS;
+    b->used = 0;
+    while (atomic_load_explicit(&b->full[b->chunk], memory_order_acquire) != 0) {
+        pthread_cond_wait(&trace_space, &trace_lock);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+
+/**
+ * @name    trace
+ * @brief   Append a record of one call to the calling thread's buffer
+ */
+static inline void trace(uint8_t op, size_t size, void * addr, uintptr_t arg) {
+    TraceBuffer * b = trace_buffer;
+    TraceRecord * r;
+
+    if (b == NULL) {
+        if (trace_busy || (b = trace_attach()) == NULL) {
+            return;
+        }
+    }
+    r = &b->records[b->chunk][b->used];
+    r->tsc = trace_clock();
+    r->addr = (uintptr_t) addr;
+    r->arg = arg;
+    r->size = size > UINT32_MAX ? UINT32_MAX : size;
+    r->thread = b->id;
+    r->op = op;
+    if (++b->used == TRACE_CHUNK) {
+        trace_hand_over(b);
+    }
+}
+
+
+/**
+ * @name    trace_thread_exit
+ * @brief   Hand the records of an exiting thread to the writer and give up its buffer
+ */
+static void trace_thread_exit(void) {
+    TraceBuffer * b = trace_buffer;
+
+    if (b != NULL) {
+        if (b->used > 0) {
+            trace_hand_over(b);
+        }
+        atomic_store(&b->retired, 1);
+        trace_buffer = NULL;
+    }
+}
+
+
+/**
+ * @name    trace_pending
+ * @brief   Does the calling thread's buffer, or that of an exited thread, hold records not yet written?
+ *
+ * Must be called with trace_lock held.
+ */
+static int trace_pending(void) {
+    TraceBuffer * b;
+    int i;
+
+    for (b = trace_buffers; b != NULL; b = b->next) {
+        if (b == trace_buffer || atomic_load(&b->retired)) {
+            for (i = 0; i < TRACE_CHUNKS; i++) {
+                if (atomic_load(&b->full[i]) != 0) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @name    simple_trace_flush
+ * @brief   Write all records of the calling thread and of exited threads to the trace file
+ *
+ * Records of other running threads are written as their chunks fill up.
+ */
+void simple_trace_flush(void) {
+    TraceBuffer * b = trace_buffer;
+
+    if (b != NULL && b->used > 0) {
+        trace_hand_over(b);
+    }
+    if (trace_fd >= 0) {
+        pthread_mutex_lock(&trace_lock);
+        while (trace_pending()) {
+            pthread_cond_wait(&trace_space, &trace_lock);
+        }
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
+
+
+#undef simple_malloc
+#undef simple_free
+#undef simple_calloc
+#undef simple_realloc
+#undef simple_memalign
+#undef simple_aligned_alloc
+#undef simple_malloc_batch
+#undef simple_free_batch
+
+void * simple_malloc(size_t size) {
+    void * ptr = untraced_malloc(size);
+    trace(TRACE_MALLOC, size, ptr, 0);
+    return ptr;
+}
+
+void simple_free(void * ptr) {
+    trace(TRACE_FREE, 0, ptr, 0);
+    untraced_free(ptr);
+}
+
+void * simple_calloc(size_t nmemb, size_t size) {
+    void * ptr = untraced_calloc(nmemb, size);
+    size_t total;
+    trace(TRACE_CALLOC, __builtin_mul_overflow(nmemb, size, &total) ? SIZE_MAX : total, ptr, nmemb);
+    return ptr;
+}
+
+void * simple_realloc(void * old, size_t size) {
+    void * ptr = untraced_realloc(old, size);
+    trace(TRACE_REALLOC, size, ptr, (uintptr_t) old);
+    return ptr;
+}
+
+void * simple_memalign(size_t alignment, size_t size) {
+    void * ptr = untraced_memalign(alignment, size);
+    trace(TRACE_MEMALIGN, size, ptr, alignment);
+    return ptr;
+}
+
+void * simple_aligned_alloc(size_t alignment, size_t size) {
+    return simple_memalign(alignment, size);
+}
+
+
+/* Batches are traced as one call per block, so they replay as such */
+size_t simple_malloc_batch(size_t size, size_t n, void ** out) {
+    size_t done = untraced_malloc_batch(size, n, out);
+    size_t i;
+    for (i = 0; i < done; i++) {
+        trace(TRACE_MALLOC, size, out[i], 0);
+    }
+    return done;
+}
+
+void simple_free_batch(void ** ptrs, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (ptrs[i] != NULL) {
+            trace(TRACE_FREE, 0, ptrs[i], 0);
+        }
+    }
+    untraced_free_batch(ptrs, n);
+}
@@ -0,0 +1,42 @@
+/**
+ * @file   trace_decode.c
+ * @brief  Turn an allocation trace written by a TRACE=1 build into CSV.
+ *
+ * Usage: trace_decode [trace file]  (mm_trace.bin by default)
+ *
+ * One line is printed per record, in file order. Records of one thread are
+ * in call order, so sort by tsc to merge the threads.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mm.h"
+
+static const char *op_names[] = { "?", "malloc", "free", "calloc", "realloc", "memalign" };
+
+int main(int argc, char **argv) {
+  const char *name = argc > 1 ? argv[1] : "mm_trace.bin";
+  FILE *f = fopen(name, "rb");
+  TraceFileHeader header;
+  TraceRecord r;
+
+  if (f == NULL) {
+    perror(name);
+    return 1;
+  }
+  if (fread(&header, sizeof(header), 1, f) != 1 || strcmp(header.magic, TRACE_MAGIC) != 0
+      || header.record_size != sizeof(TraceRecord)) {
+    fprintf(stderr, "%s: not a trace file\n", name);
+    return 1;
+  }
+
+  printf("tsc,thread,op,size,addr,arg\n");
+  while (fread(&r, sizeof(r), 1, f) == 1) {
+    printf("%llu,%u,%s,%u,0x%llx,%llu\n", (unsigned long long) r.tsc, r.thread,
+           r.op <= TRACE_MEMALIGN ? op_names[r.op] : "?", r.size,
+           (unsigned long long) r.addr, (unsigned long long) r.arg);
+  }
+  fclose(f);
+  return 0;
+}
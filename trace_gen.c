@@ -0,0 +1,155 @@
+/**
+ * @file   trace_gen.c
+ * @brief  Write synthetic allocation traces for trace_replay.
+ *
+ * Usage: trace_gen <pattern> <trace file>
+ *
+ * Patterns:
+ *   exerciser  16 slots allocated and freed round-robin with sizes shrinking
+ *              as more memory is in use, as test_memory_exerciser (scaled
+ *              down as in exerciser_bench)
+ *   churn      1000 small list nodes, a random one replaced in each step
+ *   prodcons   thread 0 allocates messages in bursts, thread 1 frees them
+ *              in the same order
+ *
+ * The traces are written in the format of a TRACE=1 build, see mm.h. The
+ * addresses are made up, but unique for every live block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm.h"
+
+#define STEPS       20000
+#define LIVE_LIMIT  (4*1024*1024)
+#define CHURN_NODES 1000
+#define QUEUE_MAX   512
+
+static FILE *out;
+static uint64_t tsc = 0;
+static uint64_t next_addr = 0x10000;
+
+static void record(uint8_t op, uint16_t thread, size_t size, uint64_t addr) {
+  TraceRecord r = { 0 };
+
+  r.tsc = tsc++;
+  r.addr = addr;
+  r.size = size;
+  r.thread = thread;
+  r.op = op;
+  fwrite(&r, sizeof(r), 1, out);
+}
+
+static uint64_t gen_malloc(uint16_t thread, size_t size) {
+  uint64_t addr = next_addr;
+
+  next_addr += (size + 15) & ~15UL;
+  record(TRACE_MALLOC, thread, size, addr);
+  return addr;
+}
+
+static void gen_free(uint16_t thread, uint64_t addr) {
+  record(TRACE_FREE, thread, 0, addr);
+}
+
+static void exerciser(void) {
+  uint64_t addr[16] = { 0 };
+  size_t size[16];
+  size_t total = 0;
+  unsigned int clock = 0;
+  int i;
+
+  for (i = 0; i < STEPS; i++) {
+    size_t s = (LIVE_LIMIT - total) / 4 * (rand() & (1024*1024 - 1)) / (1024*1024);
+
+    if (s > 0) {
+      addr[clock] = gen_malloc(0, s);
+      size[clock] = s;
+      total += s;
+    }
+    clock = (clock + 1) % 16;
+    if (addr[clock] != 0) {
+      gen_free(0, addr[clock]);
+      total -= size[clock];
+      addr[clock] = 0;
+    }
+  }
+}
+
+static void churn(void) {
+  static const size_t sizes[] = { 16, 24, 32, 48, 64 };
+  uint64_t nodes[CHURN_NODES];
+  int i;
+
+  for (i = 0; i < CHURN_NODES; i++) {
+    nodes[i] = gen_malloc(0, sizes[rand() % 5]);
+  }
+  for (i = 0; i < STEPS / 2; i++) {
+    int n = rand() % CHURN_NODES;
+    gen_free(0, nodes[n]);
+    nodes[n] = gen_malloc(0, sizes[rand() % 5]);
+  }
+}
+
+static void prodcons(void) {
+  uint64_t queue[QUEUE_MAX];
+  int head = 0;
+  int count = 0;
+  int ops = 0;
+
+  while (ops < STEPS) {
+    int burst = 1 + rand() % 32;
+
+    if (rand() % 2 == 0) {
+      /* Producer */
+      while (burst-- > 0 && count < QUEUE_MAX) {
+        queue[(head + count) % QUEUE_MAX] = gen_malloc(0, 64 + rand() % 4033);
+        count++;
+        ops++;
+      }
+    } else {
+      /* Consumer */
+      while (burst-- > 0 && count > 0) {
+        gen_free(1, queue[head]);
+        head = (head + 1) % QUEUE_MAX;
+        count--;
+        ops++;
+      }
+    }
+  }
+  while (count > 0) {
+    gen_free(1, queue[head]);
+    head = (head + 1) % QUEUE_MAX;
+    count--;
+  }
+}
+
+int main(int argc, char **argv) {
+  TraceFileHeader header = { TRACE_MAGIC, sizeof(TraceRecord), 0 };
+
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s exerciser|churn|prodcons <trace file>\n", argv[0]);
+    return 1;
+  }
+  out = fopen(argv[2], "wb");
+  if (out == NULL) {
+    perror(argv[2]);
+    return 1;
+  }
+  fwrite(&header, sizeof(header), 1, out);
+
+  srand(1);
+  if (strcmp(argv[1], "exerciser") == 0) {
+    exerciser();
+  } else if (strcmp(argv[1], "churn") == 0) {
+    churn();
+  } else if (strcmp(argv[1], "prodcons") == 0) {
+    prodcons();
+  } else {
+    fprintf(stderr, "unknown pattern %s\n", argv[1]);
+    return 1;
+  }
+  return fclose(out) == 0 ? 0 : 1;
+}
@@ -0,0 +1,298 @@
+/**
+ * @file   trace_replay.c
+ * @brief  Replay an allocation trace against simple_malloc and the system malloc.
+ *
+ * Usage: trace_replay <trace file>...
+ *
+ * A trace is written by a TRACE=1 build or by trace_gen. Its calls are
+ * replayed in time stamp order from a single thread, first with the simple
+ * allocator and then with the system allocator. Each replay runs twice:
+ * once untimed for ops/s and the peak footprint, sampled every
+ * FOOTPRINT_EVERY calls, and once timing every call for the latency
+ * percentiles. Calls that fail are counted, not retried.
+ *
+ * The simple allocator's heap starts at HEAP_SIZE, and grows by as much,
+ * so its footprint follows what the trace needs. MM_HEAP_SIZE overrides it.
+ * Neither allocator gives its footprint back, so replay one trace per
+ * process to compare footprints.
+ */
+
+#define _GNU_SOURCE   /* mallinfo2, memalign */
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mm.h"
+
+#define FOOTPRINT_EVERY (1024)
+#define HEAP_SIZE       (1024*1024)
+
+/* A call of the trace, with the blocks it uses numbered in allocation order */
+typedef struct op {
+  uint8_t op;
+  size_t size;
+  uint64_t arg;      // nmemb for calloc, alignment for memalign
+  long id;           // Block allocated, freed or resized to
+  long old;          // Block resized by realloc, -1 for none
+} Op;
+
+typedef struct allocator {
+  const char *name;
+  void *(*malloc)(size_t);
+  void (*free)(void *);
+  void *(*calloc)(size_t, size_t);
+  void *(*realloc)(void *, size_t);
+  void *(*memalign)(size_t, size_t);
+  size_t (*footprint)(void);
+} Allocator;
+
+static size_t simple_footprint(void) {
+  return simple_mallinfo().footprint;
+}
+
+static size_t system_footprint(void) {
+  struct mallinfo2 mi = mallinfo2();
+  return mi.arena + mi.hblkhd;
+}
+
+static const Allocator allocators[] = {
+  { "simple", simple_malloc, simple_free, simple_calloc, simple_realloc, simple_memalign, simple_footprint },
+  { "system", malloc, free, calloc, realloc, memalign, system_footprint },
+};
+
+static Op *ops;
+static long nops;
+static long nblocks;
+static void **blocks;
+static long *latency;
+
+static long now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static int compare_tsc(const void *a, const void *b) {
+  const TraceRecord *x = a;
+  const TraceRecord *y = b;
+  return (x->tsc > y->tsc) - (x->tsc < y->tsc);
+}
+
+static int compare_long(const void *a, const void *b) {
+  long x = *(const long *) a;
+  long y = *(const long *) b;
+  return (x > y) - (x < y);
+}
+
+/* Address to block number, the latest block at that address wins */
+static uint64_t *map_addr;
+static long *map_id;
+static size_t map_mask;
+
+static size_t map_slot(uint64_t addr) {
+  size_t i = (addr * 0x9E3779B97F4A7C15UL) >> 20 & map_mask;
+  while (map_addr[i] != 0 && map_addr[i] != addr) {
+    i = (i + 1) & map_mask;
+  }
+  return i;
+}
+
+static void map_set(uint64_t addr, long id) {
+  size_t i = map_slot(addr);
+  map_addr[i] = addr;
+  map_id[i] = id;
+}
+
+static long map_find(uint64_t addr) {
+  size_t i;
+  if (addr == 0) {
+    return -1;
+  }
+  i = map_slot(addr);
+  return map_addr[i] == addr ? map_id[i] : -1;
+}
+
+/**
+ * Read a trace and turn its records into ops
+ */
+static int load(const char *name) {
+  FILE *f = fopen(name, "rb");
+  TraceFileHeader header;
+  TraceRecord *records;
+  long n, i, size;
+
+  if (f == NULL) {
+    perror(name);
+    return -1;
+  }
+  if (fread(&header, sizeof(header), 1, f) != 1 || strcmp(header.magic, TRACE_MAGIC) != 0
+      || header.record_size != sizeof(TraceRecord)) {
+    fprintf(stderr, "%s: not a trace file\n", name);
+    fclose(f);
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  size = ftell(f) - sizeof(header);
+  fseek(f, sizeof(header), SEEK_SET);
+  n = size / sizeof(TraceRecord);
+  records = malloc(n * sizeof(TraceRecord));
+  n = fread(records, sizeof(TraceRecord), n, f);
+  fclose(f);
+  qsort(records, n, sizeof(TraceRecord), compare_tsc);
+
+  for (map_mask = 1; map_mask < 2 * (size_t) n; map_mask <<= 1) {
+  }
+  map_addr = calloc(map_mask, sizeof(uint64_t));
+  map_id = calloc(map_mask, sizeof(long));
+  map_mask--;
+
+  ops = malloc(n * sizeof(Op));
+  nops = 0;
+  nblocks = 0;
+  for (i = 0; i < n; i++) {
+    TraceRecord *r = &records[i];
+    Op *o = &ops[nops];
+
+    o->op = r->op;
+    o->size = r->size;
+    o->arg = r->arg;
+    o->old = -1;
+    switch (r->op) {
+      case TRACE_FREE:
+        if ((o->id = map_find(r->addr)) < 0) {
+          continue;   /* Allocated before the trace started */
+        }
+        break;
+      case TRACE_REALLOC:
+        o->old = map_find(r->arg);
+        /* fall through */
+      case TRACE_MALLOC:
+      case TRACE_CALLOC:
+      case TRACE_MEMALIGN:
+        o->id = nblocks++;
+        if (r->addr != 0) {
+          map_set(r->addr, o->id);
+        }
+        break;
+      default:
+        continue;
+    }
+    nops++;
+  }
+  free(records);
+  free(map_addr);
+  free(map_id);
+
+  blocks = calloc(nblocks, sizeof(void *));
+  latency = malloc(nops * sizeof(long));
+  return 0;
+}
+
+/**
+ * Perform one op, returning 0 if an allocation failed
+ */
+static inline int run_op(const Allocator *a, const Op *o) {
+  void *p;
+
+  switch (o->op) {
+    case TRACE_MALLOC:
+      p = blocks[o->id] = a->malloc(o->size);
+      break;
+    case TRACE_CALLOC:
+      p = blocks[o->id] = a->calloc(o->arg, o->arg > 0 ? o->size / o->arg : 0);
+      break;
+    case TRACE_MEMALIGN:
+      p = blocks[o->id] = a->memalign(o->arg, o->size);
+      break;
+    case TRACE_REALLOC:
+      p = a->realloc(o->old >= 0 ? blocks[o->old] : NULL, o->size);
+      if (p != NULL || o->size == 0) {
+        if (o->old >= 0) {
+          blocks[o->old] = NULL;
+        }
+        blocks[o->id] = p;
+        return 1;
+      }
+      /* The old block is still there */
+      if (o->old >= 0) {
+        blocks[o->id] = blocks[o->old];
+        blocks[o->old] = NULL;
+      }
+      return 0;
+    default:
+      a->free(blocks[o->id]);
+      blocks[o->id] = NULL;
+      return 1;
+  }
+  return p != NULL || o->size == 0;
+}
+
+static void free_all(const Allocator *a) {
+  long i;
+  for (i = 0; i < nblocks; i++) {
+    a->free(blocks[i]);
+    blocks[i] = NULL;
+  }
+}
+
+static void replay(const char *name, const Allocator *a) {
+  size_t peak = 0;
+  long failed = 0;
+  double seconds;
+  long t0, t;
+  long i;
+
+  /* Throughput and footprint */
+  t0 = now_ns();
+  for (i = 0; i < nops; i++) {
+    failed += !run_op(a, &ops[i]);
+    if (i % FOOTPRINT_EVERY == 0) {
+      size_t footprint = a->footprint();
+      peak = footprint > peak ? footprint : peak;
+    }
+  }
+  seconds = (now_ns() - t0) / 1e9;
+  free_all(a);
+
+  /* Latency */
+  for (i = 0; i < nops; i++) {
+    t = now_ns();
+    run_op(a, &ops[i]);
+    latency[i] = now_ns() - t;
+  }
+  free_all(a);
+  qsort(latency, nops, sizeof(long), compare_long);
+
+  printf("%-24s %-7s %10.0f ops/s  p50 %5ld ns  p99 %6ld ns  p99.9 %7ld ns  max %8ld ns  "
+         "peak %7zu KB  failed %ld\n", name, a->name, nops / seconds, latency[nops / 2],
+         latency[nops * 99 / 100], latency[nops * 999 / 1000], latency[nops - 1], peak / 1024, failed);
+}
+
+int main(int argc, char **argv) {
+  int i, j;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <trace file>...\n", argv[0]);
+    return 1;
+  }
+  simple_set_heap_size(HEAP_SIZE);
+  for (i = 1; i < argc; i++) {
+    if (load(argv[i]) != 0) {
+      return 1;
+    }
+    if (nops == 0) {
+      fprintf(stderr, "%s: no calls to replay\n", argv[i]);
+      continue;
+    }
+    for (j = 0; j < 2; j++) {
+      replay(argv[i], &allocators[j]);
+    }
+    free(ops);
+    free(blocks);
+    free(latency);
+  }
+  return 0;
+}